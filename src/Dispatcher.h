@@ -1,9 +1,15 @@
 #pragma once
 
 #include "common.h"
+#include "grid.h"
 #include <iostream>
 #include <vector>
+#include <cmath>
+#include <algorithm>
 #include "job.h"
+#include "numa.h"
+#include "boundary.h"
+#include "allocator.h"
 
 using namespace std;
 
@@ -27,29 +33,70 @@ struct id_vec
 
 struct Dispatcher
 {
+	// Box grid the jobs are created for
+	grid G;
 
-	// Dispatch happens in 3x3 = 9 distinct phases
-	// to avoid data races.
+	// Dispatch happens in distinct phases to avoid data races.
+	// Jobs within one phase never touch the same box.
 	int current_phase;
 
+	// Number of phases, depends on the reach of the stencil
+	int num_phases;
+
 	// Number of jobs in a phase
-	int number_of_jobs[9];
+	vector<int> number_of_jobs;
 
 	// Number of handed out jobs in a phase
-	int handed_out_jobs[9];
+	vector<int> handed_out_jobs;
 
 	// Jobs of this phase
-	vector<job> jobs[9];
+	vector<vector<job>> jobs;
+
+	// Jobs of every phase that have any pairs to calculate, as indices
+	// into jobs[ph]. Only these are handed out (see compact).
+	vector<vector<int>> active;
+
+	// Box offsets that interact with the origin box. Only one half of the
+	// neighborhood is stored (half-shell), the other half is covered by the
+	// jobs of the neighbors, since every pair force is applied to both
+	// particles.
+	vector<id_vec> stencil;
+
+	// Number of boxes the stencil reaches in x and y direction
+	int reach_x;
+	int reach_y;
+
+	// Locality aware handout (see numa.h). If enabled, the jobs of every
+	// phase are ordered by the thread owning their origin box: the jobs of
+	// thread t are [first_of_thread[ph][t], first_of_thread[ph][t + 1]).
+	bool use_owners = false;
+	vector<int> column_owner;
+	vector<vector<int>> first_of_thread;
+	vector<vector<int>> next_of_thread;
+	vector<vector<int>> steal_order;
+
+	// Seconds every thread spent on pair force jobs, for the load balance
+	// (see take_imbalance). Only measured with 'timing' set, since nothing
+	// else reads them. Every thread's time has a cache line of its own.
+	struct busy_time
+	{
+		alignas(64) double seconds = 0;
+	};
+	bool timing = false;
+	vector<busy_time, aligned_allocator<busy_time>> busy;
 
 	// Reset the dispatcher to the beginning
 	void reset()
 	{
 		current_phase = 0;
 
-		for (int ph = 0; ph < 9; ++ph)
+		for (int ph = 0; ph < num_phases; ++ph)
 		{
-			number_of_jobs[ph] = jobs[ph].size();
+			number_of_jobs[ph] = active[ph].size();
 			handed_out_jobs[ph] = 0;
+
+			if (use_owners)
+				next_of_thread[ph].assign(first_of_thread[ph].begin(), first_of_thread[ph].end() - 1);
 		}
 	}
 
@@ -72,706 +119,353 @@ struct Dispatcher
 		}
 		else
 		{
-			return jobs[current_phase][handed_out_jobs[current_phase]++];
+			return jobs[current_phase][active[current_phase][handed_out_jobs[current_phase]++]];
 		}
 	}
 
-	// Try to go to the next phase, and report back if this was succesful,
-	// or if we already did all jobs.
-	bool advance_phase()
+	// Get a chunk of consecutive undone jobs of the current phase for one of
+	// 'threads' threads: active_job(k) for k in [first, last). The jobs of a
+	// phase are ordered by row like the particles, so a thread walks a
+	// compact stretch of memory instead of jobs scattered by the other
+	// threads. Chunks start large and shrink as the phase runs out of jobs,
+	// for the load balance. With owners, jobs of the thread's own strip come
+	// first, then the ones of the threads nearby. Returns false if there are
+	// no jobs left in this phase.
+	bool get_next_chunk(int thread, int threads, int &first, int &last)
 	{
-		if (jobs_available())
-		{
-			cerr << "Cant advance phase, jobs left undone..." << endl;
-			throw 1002;
-		}
-		if (current_phase == 8)
-			return false;
-		else
+		int ph = current_phase;
+
+		if (!use_owners)
 		{
-			current_phase++;
+			int left = number_of_jobs[ph] - handed_out_jobs[ph];
+			if (left == 0)
+				return false;
+
+			first = handed_out_jobs[ph];
+			last = first + max(left / (2 * threads), 1);
+			handed_out_jobs[ph] = last;
 			return true;
 		}
-	}
 
-	// Convert box coordinates to box id
-	int vec2id(id_vec v)
-	{
-		if (valid_id(v))
+		for (auto v : steal_order[thread % steal_order.size()])
 		{
-			return v.x + v.y * num_boxes_x;
+			int left = first_of_thread[ph][v + 1] - next_of_thread[ph][v];
+			if (left > 0)
+			{
+				// Half of a strip at a time, the rest is there for
+				// stealing
+				first = next_of_thread[ph][v];
+				last = first + max(left / 2, 1);
+				next_of_thread[ph][v] = last;
+				handed_out_jobs[ph] += last - first;
+				return true;
+			}
 		}
-		else
-			return -1;
-	}
-
-	bool valid_id(id_vec v)
-	{
-		if (v.x < 0 || v.x >= num_boxes_x || v.y < 0 || v.y >= num_boxes_y)
-			return false;
 
-		return true;
+		return false;
 	}
 
-	// Move an id_vec around, considering the periodic boundaries
-	void walk_up(id_vec &v)
+	// Job k of the active jobs of the current phase
+	const job &active_job(int k) const
 	{
-		v.y += 1;
+		return jobs[current_phase][active[current_phase][k]];
 	}
 
-	void walk_up_periodic(id_vec &v)
+	// Order the jobs by the thread owning their origin box
+	void assign_owners(const numa_layout &L)
 	{
-		v.y += 1;
-		if (v.y >= num_boxes_y)
-			v.y -= num_boxes_y;
-	}
+		int T = L.num_threads;
 
-	void walk_down(id_vec &v)
-	{
-		v.y -= 1;
-	}
+		first_of_thread.assign(num_phases, vector<int>(T + 1, 0));
+		next_of_thread.assign(num_phases, vector<int>(T, 0));
+		steal_order = L.steal_order;
+		column_owner = L.column_owner;
 
-	void walk_down_periodic(id_vec &v)
-	{
-		v.y -= 1;
-		if (v.y < 0)
-			v.y += num_boxes_y;
-	}
+		for (int ph = 0; ph < num_phases; ++ph)
+			stable_sort(jobs[ph].begin(), jobs[ph].end(),
+						[&](const job &a, const job &b) { return owner(a) < owner(b); });
 
-	void walk_left(id_vec &v)
-	{
-		v.x -= 1;
+		use_owners = true;
+		activate_all();
 	}
 
-	void walk_right(id_vec &v)
+	// Thread owning the origin box of a job
+	int owner(const job &J) const
 	{
-		v.x += 1;
+		return column_owner[J.origin % G.num_boxes_x];
 	}
 
-	Dispatcher()
+	// Whether a job has any pairs to calculate: the origin holds a particle
+	// and one of the other boxes does, or the origin holds two and the job
+	// includes the pairs within the origin.
+	static bool has_pairs(const job &J, const vector<vector<int>> &box)
 	{
+		size_t n = box[J.origin].size();
 
-		// Create the jobs:
-		// We create "agents" that are spaced 2 boxes from each
-		// other. Each of the agent creates a job that is pushed
-		// to the job list. Next we walk the agents to their next
-		// block and repeat the process, sparing the combinations we've
-		// already did before
-
-		int agents_x = int(num_boxes_x / 3) + 1; // Non-periodic boundary
-		int agents_y = int(num_boxes_y / 3) + 1; // Periodic boundary
-
-		// Total number of agents
-		int num_agents = agents_x * agents_y;
-
-		// List of agents, containin the id he's pointing to
-		vector<id_vec> agent(num_agents);
-
-		// Check if the box coordinates are valid and within
-		// the simulation domain
-
-		// Initialize the agents
-		for (int i = 0; i < agents_x; ++i)
-			for (int j = 0; j < agents_y; ++j)
-			{
-				int idx = i + j * agents_x;
-				agent[idx] = id_vec(3 * i, 3 * j);
-			}
-
-		// Now we create the phases.
+		if (n == 0)
+			return false;
+		if (J.self && n >= 2)
+			return true;
 
-		// 1st phase, all of the surrounding ids will be calculated,
-		// as well as the cell itself
+		for (int k = 0; k < J.count; ++k)
+			if (!box[J.id[k]].empty())
+				return true;
 
-		current_phase = 0;
+		return false;
+	}
 
-		for (int k = 0; k < num_agents; ++k)
+	// Hand out only the jobs of the current occupancy of the boxes. Empty
+	// regions (large sparse domains, the vacuum around a blast) then cost
+	// neither scheduling nor idle time at the phase barriers. A worksharing
+	// loop: all threads of the parallel region call it and share the
+	// phases. The dispatcher has to be reset afterwards.
+	void compact(const vector<vector<int>> &box)
+	{
+#pragma omp for schedule(dynamic, 1)
+		for (int ph = 0; ph < num_phases; ++ph)
 		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
-
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
-
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
-
-				bool periodic = (A.y == 0);
-
-				if (periodic)
-				{
-					//Lower S
-					walk_down_periodic(A);
-					walk_down_periodic(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					// Lower SW
-					walk_left(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					//Lower SE
-					walk_right(A);
-					walk_right(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					// Back to origin
-					walk_left(A);
-					walk_up_periodic(A);
-					walk_up_periodic(A);
-				}
+			active[ph].clear();
+			for (int j = 0; j < int(jobs[ph].size()); ++j)
+				if (has_pairs(jobs[ph][j], box))
+					active[ph].push_back(j);
 
-				// N
-				periodic ? walk_up_periodic(A) : walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// NE
-				walk_right(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// E
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// SE
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// S
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// SW
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// W
-				periodic ? walk_up_periodic(A) : walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// NW
-				periodic ? walk_up_periodic(A) : walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// If we're at the top of the domain we need to check an additional
-				// layer of boxes, since the first one is probably too small for the
-				// interaction
-
-				// Back to origin
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				walk_right(A);
-
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
-			}
+			if (use_owners)
+				count_owners(ph);
 		}
+	}
 
-		// 2nd phase, we spare W now, since we already did this combo before.
-		current_phase = 1;
-
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
-			walk_right(agent[k]);
-
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
+	// Load imbalance of the jobs done since the last call: the time the
+	// busiest thread spent on them relative to the average, minus one
+	double take_imbalance()
+	{
+		double sum = 0;
+		double most = 0;
+		for (auto &t : busy)
 		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
-
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
-				bool periodic = (A.y == 0);
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
-
-				if (periodic)
-				{
-					//Lower S
-					walk_down_periodic(A);
-					walk_down_periodic(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					// Lower SW
-					walk_left(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					//Lower SE
-					walk_right(A);
-					walk_right(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					// Back to origin
-					walk_left(A);
-					walk_up_periodic(A);
-					walk_up_periodic(A);
-				}
-
-				// N
-				periodic ? walk_up_periodic(A) : walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// NE
-				walk_right(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// E
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// SE
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// S
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// SW
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// W (SPARED)
-				periodic ? walk_up_periodic(A) : walk_up(A);
-
-				// NW
-				periodic ? walk_up_periodic(A) : walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// Back to origin
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				walk_right(A);
-
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
-			}
+			sum += t.seconds;
+			most = max(most, t.seconds);
 		}
 
-		// 3rd phase, we spare W and E, since we already did these combos before.
-		current_phase = 2;
-
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
-			walk_right(agent[k]);
-
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
-		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
-
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
-				bool periodic = (A.y == 0);
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
-
-				if (periodic)
-				{
-					//Lower S
-					walk_down_periodic(A);
-					walk_down_periodic(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					// Lower SW
-					walk_left(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					//Lower SE
-					walk_right(A);
-					walk_right(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					// Back to origin
-					walk_left(A);
-					walk_up_periodic(A);
-					walk_up_periodic(A);
-				}
-
-				// N
-				periodic ? walk_up_periodic(A) : walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// NE
-				walk_right(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		busy.assign(busy.size(), busy_time());
 
-				// E (SPARED)
-				periodic ? walk_down_periodic(A) : walk_down(A);
-
-				// SE
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// S
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// SW
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// W (SPARED)
-				periodic ? walk_up_periodic(A) : walk_up(A);
-
-				// NW
-				periodic ? walk_up_periodic(A) : walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				if (periodic)
-				{
-					//Upper NW
-					walk_up_periodic(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					//Upper N
-					walk_right(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					//Upper NE
-					walk_right(A);
-					if (valid_id(A))
-						new_job.add_id(vec2id(A));
-
-					// Back to the previous position
-					walk_left(A);
-					walk_left(A);
-					walk_down_periodic(A);
-				}
-
-				// Back to origin
-				periodic ? walk_down_periodic(A) : walk_down(A);
-				walk_right(A);
-
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
-			}
-		}
+		if (sum == 0)
+			return 0;
+		return most * busy.size() / sum - 1;
+	}
 
-		// 4th phase, sparing NW, N and NE.
-		current_phase = 3;
+	// Hand out all jobs
+	void activate_all()
+	{
+		active.resize(num_phases);
 
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
+		for (int ph = 0; ph < num_phases; ++ph)
 		{
-			walk_left(agent[k]);
-			walk_left(agent[k]);
-			walk_down(agent[k]);
-		}
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
-		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
+			active[ph].resize(jobs[ph].size());
+			for (int j = 0; j < int(jobs[ph].size()); ++j)
+				active[ph][j] = j;
 
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
-
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
+			if (use_owners)
+				count_owners(ph);
+		}
 
-				// E
-				walk_right(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		reset();
+	}
 
-				// SE
-				walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+	// Ranges of the active jobs of every thread. The jobs are sorted by
+	// owner, so are the active ones.
+	void count_owners(int ph)
+	{
+		vector<int> &first = first_of_thread[ph];
+		first.assign(first.size(), 0);
 
-				// S
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		for (auto j : active[ph])
+			first[owner(jobs[ph][j]) + 1]++;
 
-				// SW
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		for (size_t t = 1; t < first.size(); ++t)
+			first[t] += first[t - 1];
+	}
 
-				// W
-				walk_up(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+	// Replace the jobs of the box grid by jobs created elsewhere (see
+	// quadtree.h). Jobs within every phase must not share a box.
+	void set_jobs(const vector<vector<job>> &phases)
+	{
+		jobs = phases;
+		num_phases = jobs.size();
+		number_of_jobs.assign(num_phases, 0);
+		handed_out_jobs.assign(num_phases, 0);
+		use_owners = false;
 
-				// Back to origin
-				walk_right(A);
+		activate_all();
+	}
 
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
-			}
+	// Try to go to the next phase, and report back if this was succesful,
+	// or if we already did all jobs.
+	bool advance_phase()
+	{
+		if (jobs_available())
+		{
+			cerr << "Cant advance phase, jobs left undone..." << endl;
+			throw 1002;
 		}
 
-		// 5th phase, Sparing NW, N, NE and W.
-		current_phase = 4;
+		// Phases without active jobs don't need a barrier of their own
+		int next = current_phase + 1;
+		while (next < num_phases && number_of_jobs[next] == 0)
+			++next;
 
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
-			walk_right(agent[k]);
-
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
+		if (next == num_phases)
+			return false;
+		else
 		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
-
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
-
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
-
-				// E
-				walk_right(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// SE
-				walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// S
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// SW
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// Back to origin
-				walk_up(A);
-				walk_right(A);
-
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
-			}
+			current_phase = next;
+			return true;
 		}
+	}
 
-		// 6th phase, NW, N, NE, E and W, since we already did these combos before.
-		current_phase = 5;
-
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
-			walk_right(agent[k]);
-
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
+	// Convert box coordinates to box id
+	int vec2id(id_vec v)
+	{
+		if (valid_id(v))
 		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
+			return v.x + v.y * G.num_boxes_x;
+		}
+		else
+			return -1;
+	}
 
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
+	bool valid_id(id_vec v)
+	{
+		if (v.x < 0 || v.x >= G.num_boxes_x || v.y < 0 || v.y >= G.num_boxes_y)
+			return false;
 
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
+		return true;
+	}
 
-				// E (SPARED)
-				walk_right(A);
+	// Move an id_vec back into the domain through the periodic
+	// (north and south) boundaries
+	void wrap(id_vec &v)
+	{
+		v.y %= G.num_boxes_y;
+		if (v.y < 0)
+			v.y += G.num_boxes_y;
+	}
 
-				// SE
-				walk_down(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+	// Create the half-shell stencil: all box offsets whose boxes can contain
+	// particles within box_cutoff of a particle in the origin box. Of every
+	// pair of opposite offsets only the one pointing north (or east, within
+	// the same row) is kept.
+	void create_stencil()
+	{
+		reach_x = int(ceil(box_cutoff / G.box_size_x));
+		reach_y = int(ceil(box_cutoff / G.box_size_y));
 
-				// S
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		stencil.clear();
 
-				// SW
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		for (int dy = 0; dy <= reach_y; ++dy)
+			for (int dx = -reach_x; dx <= reach_x; ++dx)
+			{
+				// Spare the origin and the southern half
+				if (dy == 0 && dx <= 0)
+					continue;
 
-				// Back to origin
-				walk_up(A);
-				walk_right(A);
+				// Smallest distance between two points of the boxes
+				scalar gap_x = max(abs(dx) - 1, 0) * G.box_size_x;
+				scalar gap_y = max(dy - 1, 0) * G.box_size_y;
 
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
+				if (gap_x * gap_x + gap_y * gap_y < box_cutoff * box_cutoff)
+					stencil.push_back(id_vec(dx, dy));
 			}
-		}
-
-		// 7th phase, only E and W.
-		current_phase = 6;
-
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
-		{
-			walk_left(agent[k]);
-			walk_left(agent[k]);
-			walk_down(agent[k]);
-		}
-
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
-		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
+	}
 
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
+	// Phase of a job with the origin at box v. Jobs write into the boxes
+	// [x - reach_x, x + reach_x] x [y, y + reach_y], so origins spaced
+	// 2 * reach_x + 1 boxes in x and reach_y + 1 boxes in y direction can
+	// run in the same phase. The rows left over at the northern end of the
+	// periodic domain get a phase of their own each.
+	int phase_of(id_vec v)
+	{
+		int period_x = 2 * reach_x + 1;
+		int period_y = reach_y + 1;
 
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
+		// Rows that fit into complete periods
+		int full_rows = (G.num_boxes_y / period_y) * period_y;
 
-				// E
-				walk_right(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		int color_x = v.x % period_x;
+		int color_y = v.y < full_rows ? v.y % period_y : period_y + v.y - full_rows;
 
-				// E
-				walk_left(A);
-				walk_left(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
+		return color_x + color_y * period_x;
+	}
 
-				// Back to origin
-				walk_right(A);
+	// Without create_jobs only the stencil is set up, for box grids too
+	// large to hold a job per box (see parameters::out_of_core_dir)
+	Dispatcher(const grid &box_grid, bool create_jobs = true)
+	{
+		G = box_grid;
+		create_stencil();
 
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
-			}
+		// With too few rows the stencil would see a box (or a pair of boxes)
+		// twice through the periodic boundary
+		if (north_wall::periodic && G.num_boxes_y <= 2 * reach_y)
+		{
+			cerr << "Domain too small for the periodic boundaries: " << G.num_boxes_y
+				 << " rows of boxes, need more than " << 2 * reach_y << endl;
+			throw 1003;
 		}
 
-		// 8th phase, only E.
-		current_phase = 7;
+		int period_x = 2 * reach_x + 1;
+		int period_y = reach_y + 1;
 
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
+		if (!create_jobs)
 		{
-			walk_right(agent[k]);
+			num_phases = 0;
+			activate_all();
+			return;
 		}
 
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
-		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
-			{
-
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
-
-				// Now we walk around the origin and add the box to the
-				// job if its valid.
-
-				// E
-				walk_right(A);
-				if (valid_id(A))
-					new_job.add_id(vec2id(A));
-
-				// Back to origin
-				walk_left(A);
+		// Stencils larger than a job are split into several jobs, every
+		// part gets its own set of phases
+		int colors = period_x * (period_y + G.num_boxes_y % period_y);
+		int parts = max(int(stencil.size() + job_capacity - 1) / job_capacity, 1);
 
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
-			}
-		}
+		num_phases = colors * parts;
 
-		// 9th phase, (only self).
-		current_phase = 8;
+		jobs.assign(num_phases, vector<job>());
+		number_of_jobs.assign(num_phases, 0);
+		handed_out_jobs.assign(num_phases, 0);
 
-		// First, move all Agents
-		for (int k = 0; k < num_agents; ++k)
-		{
-			walk_right(agent[k]);
-		}
+		// Create one job per box, containing all boxes of the stencil
+		// that lie within the domain
+		vector<pair<int, scalar>> neighbors;
 
-		// And create the new jobs
-		for (int k = 0; k < num_agents; ++k)
-		{
-			id_vec &A = agent[k];
-			// Check if the agent is inside the domain, otherwise we will
-			// ignore him for now. He might walk back into the domain later
-			if (valid_id(A))
+		for (int y = 0; y < G.num_boxes_y; ++y)
+			for (int x = 0; x < G.num_boxes_x; ++x)
 			{
+				id_vec A(x, y);
+				neighbors.clear();
 
-				// Create a new job that will be initialized and then
-				// pushed to the job list
-				job new_job;
-				new_job.origin = vec2id(A);
-				// Add the job to this phase's list
-				jobs[current_phase].push_back(new_job);
+				for (auto s : stencil)
+				{
+					id_vec B(A.x + s.x, A.y + s.y);
+
+					// Boxes beyond the northern boundary are the periodic
+					// images of the southern boxes, shifted up by one height
+					scalar shift = 0;
+					if (north_wall::periodic && B.y >= G.num_boxes_y)
+					{
+						shift = G.height;
+						wrap(B);
+					}
+
+					if (valid_id(B))
+						neighbors.push_back(make_pair(vec2id(B), shift));
+				}
+
+				split_jobs(vec2id(A), neighbors, [&](const job &J, int part) {
+					jobs[phase_of(A) + part * colors].push_back(J);
+				});
 			}
-		}
 
 		// Initialize the dispatcher for first use
-		reset();
+		activate_all();
 	}
-};
\ No newline at end of file
+};
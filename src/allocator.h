@@ -0,0 +1,110 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include "mapped.h"
+
+// Allocator that leaves default construction to the user. A vector using it
+// can be resized without touching its memory, so the pages end up on the
+// NUMA node of the thread that writes them first (see first_touch in numa.h).
+// Construction with arguments (copies) works as usual. The memory is
+// aligned to cache lines, large lists get huge pages (see allocate_block).
+// Given a directory, the memory is a file mapped from there instead (see
+// mapped.h). The directory name has to outlive the allocator. The memory
+// follows its list through swaps and assignments.
+template <class T>
+struct first_touch_allocator
+{
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_swap;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_copy_assignment;
+
+	// Directory of the files, nullptr for ordinary memory
+	const char *directory = nullptr;
+
+	first_touch_allocator(const char *file_directory = nullptr) : directory(file_directory) {}
+
+	template <class U>
+	first_touch_allocator(const first_touch_allocator<U> &other) : directory(other.directory)
+	{
+	}
+
+	T *allocate(size_t n)
+	{
+		if (directory)
+			return static_cast<T *>(map_file(directory, n * sizeof(T)));
+
+		return static_cast<T *>(allocate_block(n * sizeof(T)));
+	}
+
+	void deallocate(T *ptr, size_t n)
+	{
+		if (directory)
+			unmap_file(ptr, n * sizeof(T));
+		else
+			free_block(ptr, n * sizeof(T));
+	}
+
+	// Default construction is deferred
+	template <class U>
+	void construct(U *)
+	{
+	}
+
+	template <class U, class... Args>
+	void construct(U *ptr, Args &&... args)
+	{
+		::new ((void *)ptr) U(std::forward<Args>(args)...);
+	}
+};
+
+template <class T, class U>
+bool operator==(const first_touch_allocator<T> &a, const first_touch_allocator<U> &b)
+{
+	return a.directory == b.directory;
+}
+
+template <class T, class U>
+bool operator!=(const first_touch_allocator<T> &a, const first_touch_allocator<U> &b)
+{
+	return !(a == b);
+}
+
+// Plain allocator of cache line aligned memory (see allocate_block), for
+// the arrays the kernels vectorize over
+template <class T>
+struct aligned_allocator
+{
+	typedef T value_type;
+
+	aligned_allocator() {}
+
+	template <class U>
+	aligned_allocator(const aligned_allocator<U> &)
+	{
+	}
+
+	T *allocate(size_t n)
+	{
+		return static_cast<T *>(allocate_block(n * sizeof(T)));
+	}
+
+	void deallocate(T *ptr, size_t n)
+	{
+		free_block(ptr, n * sizeof(T));
+	}
+};
+
+template <class T, class U>
+bool operator==(const aligned_allocator<T> &, const aligned_allocator<U> &)
+{
+	return true;
+}
+
+template <class T, class U>
+bool operator!=(const aligned_allocator<T> &, const aligned_allocator<U> &)
+{
+	return false;
+}
@@ -0,0 +1,194 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+#include "autotune.h"
+#include "simulation.h"
+#include "numa.h"
+
+using namespace std;
+
+scalar time_steps(const parameters &P)
+{
+	set_thread_count(P.threads);
+
+	try
+	{
+		Simulation S(P);
+
+		// Let the threads, caches and the incremental rebinning settle
+		S.step(P.tune_steps / 4 + 1);
+
+		auto start = chrono::steady_clock::now();
+		S.step(P.tune_steps);
+		chrono::duration<scalar> elapsed = chrono::steady_clock::now() - start;
+
+		return elapsed.count() / P.tune_steps;
+	}
+	catch (int e)
+	{
+		return -1;
+	}
+}
+
+// The settings the autotuner chooses, in the form of the command line
+static void print_settings(const parameters &P, ostream &out)
+{
+	out << "threads=" << P.threads << " box_subdivision=" << P.box_subdivision
+		<< " kernel=" << (P.kernel == KERNEL_DIRECT ? "direct" : "tiled") << " tasks=" << P.task_graph;
+}
+
+// Key of a system in the cache: everything the best settings depend on,
+// including the modes that rule some of them out
+static string cache_key(const parameters &P, int max_threads)
+{
+	ostringstream key;
+	key << P.N << " " << P.width << " " << P.height << " " << P.adaptive << " " << max_threads << " "
+		<< P.deterministic << " " << scheme_name(P.integrator) << " " << P.block_levels << " " << P.temporal_block << " "
+		<< !P.out_of_core_dir.empty();
+	return key.str();
+}
+
+// Look up the settings of a system in the cache file. Every line is the key
+// followed by ": threads box_subdivision kernel tasks step_time". Settings
+// that don't work with the rest of P (a cache written by hand or by an
+// older version) count as not found.
+static bool read_cache(parameters &P, const string &key)
+{
+	ifstream in(P.tune_file);
+	string line;
+
+	while (getline(in, line))
+	{
+		size_t colon = line.find(':');
+		if (colon == string::npos || line.substr(0, colon) != key)
+			continue;
+
+		istringstream values(line.substr(colon + 1));
+		int threads, subdivision, kernel, tasks;
+		if (values >> threads >> subdivision >> kernel >> tasks)
+		{
+			parameters C = P;
+			C.threads = threads;
+			C.box_subdivision = subdivision;
+			C.kernel = force_kernel(kernel);
+			C.task_graph = tasks != 0;
+
+			if (invalid_parameters(C))
+				continue;
+
+			P = C;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void write_cache(const parameters &P, const string &key, scalar step_time)
+{
+	ofstream out(P.tune_file, ios::app);
+	out << key << ": " << P.threads << " " << P.box_subdivision << " " << int(P.kernel) << " " << P.task_graph << " "
+		<< step_time << endl;
+}
+
+void autotune(parameters &P, ostream &log)
+{
+	int max_threads = thread_count();
+	string key = cache_key(P, max_threads);
+
+	if (read_cache(P, key))
+	{
+		log << "Tuned settings from " << P.tune_file << ": ";
+		print_settings(P, log);
+		log << endl;
+		return;
+	}
+
+	// All candidates have to see the same system
+	parameters Q = P;
+	if (Q.seed == 0)
+		Q.seed = ::time(NULL);
+	Q.dump_file = "";
+	Q.rdf_interval = 0;
+	Q.field_interval = 0;
+	Q.threads = max_threads;
+	Q.task_graph = false;
+
+	parameters best = Q;
+	scalar best_time = -1;
+
+	// Measure one candidate, keep it if it is the fastest so far
+	auto measure = [&](const parameters &C) {
+		scalar t = time_steps(C);
+
+		log << "  ";
+		print_settings(C, log);
+		log << ": ";
+		if (t < 0)
+			log << "failed" << endl;
+		else
+			log << t * 1e3 << " ms/step" << endl;
+
+		if (t >= 0 && (best_time < 0 || t < best_time))
+		{
+			best = C;
+			best_time = t;
+		}
+	};
+
+	log << "Autotuning " << P.N << " particles on " << P.width << " x " << P.height << endl;
+
+	// Box size and kernel, with all threads
+	for (int subdivision = 1; subdivision <= 3; ++subdivision)
+		for (auto kernel : {KERNEL_DIRECT, KERNEL_TILED})
+		{
+			parameters C = Q;
+			C.box_subdivision = subdivision;
+			C.kernel = kernel;
+			measure(C);
+		}
+
+	// Thread count: powers of two and all threads
+	vector<int> thread_candidates;
+	for (int t = 1; t < max_threads; t *= 2)
+		thread_candidates.push_back(t);
+
+	parameters base = best;
+	for (auto t : thread_candidates)
+	{
+		parameters C = base;
+		C.threads = t;
+		measure(C);
+	}
+
+	// Scheduling of the force calculation, where the task graph works with
+	// the other settings (block time steps and sweeps have their own, the
+	// task graph only does velocity verlet and isn't deterministic)
+	base = best;
+	base.task_graph = true;
+	if (!invalid_parameters(base))
+		measure(base);
+
+	set_thread_count(max_threads);
+
+	if (best_time < 0)
+	{
+		log << "All candidates failed, keeping the given settings" << endl;
+		return;
+	}
+
+	P.threads = best.threads;
+	P.box_subdivision = best.box_subdivision;
+	P.kernel = best.kernel;
+	P.task_graph = best.task_graph;
+
+	write_cache(P, key, best_time);
+
+	log << "Chose ";
+	print_settings(P, log);
+	log << " (" << best_time * 1e3 << " ms/step)" << endl;
+}
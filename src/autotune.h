@@ -0,0 +1,26 @@
+#pragma once
+#include <ostream>
+#include "common.h"
+#include "parameters.h"
+
+using namespace std;
+
+// AUTOTUNING
+// The fastest setup depends on the system: many threads win for millions
+// of particles and lose badly for a hundred (see measurements.txt), and the
+// best box size and kernel depend on the density. The autotuner runs the
+// actual system for a few steps with every candidate setting and keeps the
+// fastest one.
+
+// Time per step of a short run of system P: tune_steps steps after a few
+// warmup steps, with P.threads threads. Negative if the system fails.
+scalar time_steps(const parameters &P);
+
+// Choose threads, box_subdivision, kernel and task_graph for P. Settings
+// cached in P.tune_file for a system of the same size, shape and modes
+// (and thread count available) are taken from there if they are valid for
+// P, otherwise the candidates are measured one setting at a time (box size
+// and kernel with all threads, then the thread count, then the scheduling)
+// and the result is added to the cache. The measurements are reported to
+// 'log'.
+void autotune(parameters &P, ostream &log);
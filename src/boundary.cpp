@@ -0,0 +1,110 @@
+#include <cmath>
+#include <algorithm>
+#include "boundary.h"
+
+using namespace std;
+
+Boundaries::Boundaries(const grid &box_grid)
+{
+	G = box_grid;
+
+	// Number of box columns and rows within box_cutoff of a wall
+	int reach_x = int(ceil(box_cutoff / G.box_size_x));
+	int reach_y = int(ceil(box_cutoff / G.box_size_y));
+
+	for (int y = 0; y < G.num_boxes_y; ++y)
+		for (int x = 0; x < G.num_boxes_x; ++x)
+		{
+			int id = x + y * G.num_boxes_x;
+
+			if ((west_wall::has_force && x < reach_x) ||
+				(east_wall::has_force && x >= G.num_boxes_x - reach_x) ||
+				(south_wall::has_force && y < reach_y) ||
+				(north_wall::has_force && y >= G.num_boxes_y - reach_y))
+				force_boxes.push_back(id);
+
+			if (x == 0)
+				west_boxes.push_back(id);
+			if (x == G.num_boxes_x - 1)
+				east_boxes.push_back(id);
+			if (y == 0)
+				south_boxes.push_back(id);
+			if (y == G.num_boxes_y - 1)
+				north_boxes.push_back(id);
+		}
+}
+
+void clear_force(particle_list &p)
+{
+#pragma omp for schedule(static)
+	for (size_t idx = 0; idx < p.size(); ++idx)
+	{
+		particle &i = p[idx];
+		i.pF = i.F;
+		i.F = vec(0, 0);
+	}
+}
+
+void wall_force(particle_list &p, vector<vector<int>> &box, const Boundaries &B)
+{
+#pragma omp for schedule(static)
+	for (size_t b = 0; b < B.force_boxes.size(); ++b)
+		wall_force(p, box[B.force_boxes[b]], B.G);
+}
+
+void wall_force(particle_list &p, const vector<int> &ids, const grid &G)
+{
+	for (auto idx : ids)
+		add_wall_force(p[idx], G);
+}
+
+size_t cross_walls(particle_list &p, vector<vector<int>> &box, const Boundaries &B, vector<int> *removed_ids)
+{
+	const grid &G = B.G;
+
+	// Particles to be removed
+	vector<int> removed;
+
+	if (removed_ids)
+		removed_ids->clear();
+
+	for (auto b : B.west_boxes)
+		for (auto idx : box[b])
+			if (p[idx].r.x < 0 && !west_wall::cross(p[idx].r.x, p[idx].v.x, 0, G.width))
+				removed.push_back(idx);
+
+	for (auto b : B.east_boxes)
+		for (auto idx : box[b])
+			if (p[idx].r.x > G.width && !east_wall::cross(p[idx].r.x, p[idx].v.x, G.width, 0))
+				removed.push_back(idx);
+
+	for (auto b : B.south_boxes)
+		for (auto idx : box[b])
+			if (p[idx].r.y < 0 && !south_wall::cross(p[idx].r.y, p[idx].v.y, 0, G.height))
+				removed.push_back(idx);
+
+	for (auto b : B.north_boxes)
+		for (auto idx : box[b])
+			if (p[idx].r.y > G.height && !north_wall::cross(p[idx].r.y, p[idx].v.y, G.height, 0))
+				removed.push_back(idx);
+
+	if (removed.empty())
+		return 0;
+
+	// A particle in a corner might have been removed by two walls
+	sort(removed.begin(), removed.end());
+	removed.erase(unique(removed.begin(), removed.end()), removed.end());
+
+	if (removed_ids)
+		*removed_ids = removed;
+
+	// Fill the gaps with particles from the end, starting with the highest
+	// index so that no particle is moved twice
+	for (auto it = removed.rbegin(); it != removed.rend(); ++it)
+	{
+		p[*it] = p.back();
+		p.pop_back();
+	}
+
+	return removed.size();
+}
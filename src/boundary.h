@@ -0,0 +1,230 @@
+#pragma once
+#include <vector>
+#include "common.h"
+#include "grid.h"
+#include "particle.h"
+#include "force.h"
+
+using namespace std;
+
+// Boundary condition policies. Every wall of the domain gets one of these
+// at compile time (see the typedefs at the end of this file). A policy
+// provides:
+//
+//   periodic      the wall is glued to the opposite one
+//   has_force     the wall exerts a force on nearby particles
+//   force(d)      that force, for a particle at distance d from the wall,
+//                 positive pointing into the domain
+//   potential(d)  potential energy belonging to the force
+//   cross(r, v, wall, other_wall)
+//                 called for particles that crossed the wall during the
+//                 drift, with the position and velocity component normal to
+//                 the wall. Returns false if the particle has to be removed.
+//
+// Policies are only applied to the boxes along the walls, interior
+// particles never pay for them.
+
+// Opposite walls are identified, particles leaving on one side enter on the
+// other one
+struct periodic_wall
+{
+	static const bool periodic = true;
+	static const bool has_force = false;
+
+	static scalar force(scalar)
+	{
+		return 0;
+	}
+
+	static scalar potential(scalar)
+	{
+		return 0;
+	}
+
+	static bool cross(scalar &r, scalar &, scalar wall, scalar other_wall)
+	{
+		r += other_wall - wall;
+		return true;
+	}
+};
+
+// Lennard-Jones repulsion from the wall. Particles are not supposed to get
+// through, if they do the invariant check will report it.
+struct lj_wall
+{
+	static const bool periodic = false;
+	static const bool has_force = true;
+
+	static scalar force(scalar d)
+	{
+		return -lennard_jones(d);
+	}
+
+	static scalar potential(scalar d)
+	{
+		return lennard_jones_potential(d);
+	}
+
+	static bool cross(scalar &, scalar &, scalar, scalar)
+	{
+		return true;
+	}
+};
+
+// Hard wall, particles are mirrored back into the domain
+struct reflective_wall
+{
+	static const bool periodic = false;
+	static const bool has_force = false;
+
+	static scalar force(scalar)
+	{
+		return 0;
+	}
+
+	static scalar potential(scalar)
+	{
+		return 0;
+	}
+
+	static bool cross(scalar &r, scalar &v, scalar wall, scalar)
+	{
+		r = 2 * wall - r;
+		v = -v;
+		return true;
+	}
+};
+
+// Particles hitting the wall are removed from the simulation
+struct absorbing_wall
+{
+	static const bool periodic = false;
+	static const bool has_force = false;
+
+	static scalar force(scalar)
+	{
+		return 0;
+	}
+
+	static scalar potential(scalar)
+	{
+		return 0;
+	}
+
+	static bool cross(scalar &, scalar &, scalar, scalar)
+	{
+		return false;
+	}
+};
+
+// BOUNDARY CONDITIONS
+// North and south are periodic, east and west are LJ repulsive.
+// Periodic boundaries are only implemented for north and south.
+// The macros allow to set the policies from the command line of the
+// compiler ('make check' does this), the defaults are the ones used.
+#ifndef WEST_WALL
+#define WEST_WALL lj_wall
+#endif
+#ifndef EAST_WALL
+#define EAST_WALL lj_wall
+#endif
+#ifndef SOUTH_WALL
+#define SOUTH_WALL periodic_wall
+#endif
+#ifndef NORTH_WALL
+#define NORTH_WALL periodic_wall
+#endif
+
+typedef WEST_WALL west_wall;
+typedef EAST_WALL east_wall;
+typedef SOUTH_WALL south_wall;
+typedef NORTH_WALL north_wall;
+
+static_assert(north_wall::periodic == south_wall::periodic,
+			  "Periodic boundaries have to be set on both north and south");
+static_assert(!west_wall::periodic && !east_wall::periodic,
+			  "Periodic boundaries are only implemented for north and south");
+
+// Boxes along the walls, created once for the box grid
+struct Boundaries
+{
+	// Box grid the lists are created for
+	grid G;
+
+	// Boxes within box_cutoff of a wall exerting a force
+	vector<int> force_boxes;
+
+	// Outermost boxes, the only ones particles can leave the domain from
+	vector<int> west_boxes;
+	vector<int> east_boxes;
+	vector<int> south_boxes;
+	vector<int> north_boxes;
+
+	Boundaries(const grid &box_grid);
+};
+
+// Backup the force to pF and initialize it to zero, for all particles.
+// Must be called from within a parallel region.
+void clear_force(particle_list &p);
+
+// Add the wall forces to the particles in the wall boxes.
+// Must be called from within a parallel region.
+void wall_force(particle_list &p, vector<vector<int>> &box, const Boundaries &B);
+
+// Add the wall forces to the particles 'ids' of a single box
+void wall_force(particle_list &p, const vector<int> &ids, const grid &G);
+
+// Force of the walls on a particle at r
+inline vec wall_force_at(const vec &r, const grid &G)
+{
+	vec F(0, 0);
+
+	// Forces are perpendicular to the walls. Walls without a force are
+	// removed at compile time.
+	if (west_wall::has_force && r.x < box_cutoff)
+		F.x += west_wall::force(r.x);
+
+	if (east_wall::has_force && r.x > G.width - box_cutoff)
+		F.x -= east_wall::force(G.width - r.x);
+
+	if (south_wall::has_force && r.y < box_cutoff)
+		F.y += south_wall::force(r.y);
+
+	if (north_wall::has_force && r.y > G.height - box_cutoff)
+		F.y -= north_wall::force(G.height - r.y);
+
+	return F;
+}
+
+// Add the wall forces to a single particle
+inline void add_wall_force(particle &i, const grid &G)
+{
+	i.F += wall_force_at(i.r, G);
+}
+
+// Apply the wall policies to a single particle after its drift. Returns
+// false if the particle has to be removed.
+inline bool cross_walls(particle &i, const grid &G)
+{
+	bool keep = true;
+
+	if (i.r.x < 0)
+		keep = west_wall::cross(i.r.x, i.v.x, 0, G.width) && keep;
+	if (i.r.x > G.width)
+		keep = east_wall::cross(i.r.x, i.v.x, G.width, 0) && keep;
+	if (i.r.y < 0)
+		keep = south_wall::cross(i.r.y, i.v.y, 0, G.height) && keep;
+	if (i.r.y > G.height)
+		keep = north_wall::cross(i.r.y, i.v.y, G.height, 0) && keep;
+
+	return keep;
+}
+
+// Apply the wall policies to particles that crossed a wall in the drift.
+// Box lists have to be the ones from before the drift. Removed (absorbed)
+// particles are taken out of the particle list, which changes the order of
+// the particles and invalidates the box lists. Returns the number of
+// removed particles, their indices (ascending) go to removed_ids if given.
+// Each removed particle was replaced by the last one, highest index first.
+size_t cross_walls(particle_list &p, vector<vector<int>> &box, const Boundaries &B,
+				   vector<int> *removed_ids = nullptr);
@@ -0,0 +1,118 @@
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include "common.h"
+#include "check.h"
+
+using namespace std;
+
+// Test for NaN or inf by looking at the exponent bits. We can't use isnan
+// here, since -Ofast (-ffinite-math-only) lets the compiler assume that
+// there are no NaNs and remove the test altogether.
+static inline int not_finite(double d)
+{
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return (bits & 0x7ff0000000000000ull) == 0x7ff0000000000000ull;
+}
+
+static inline int not_finite(float f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return (bits & 0x7f800000u) == 0x7f800000u;
+}
+
+// Error code of a single particle, 0 if it is fine
+static inline int particle_error(const grid &G, const particle &i)
+{
+	if (not_finite(i.r.x) | not_finite(i.r.y) | not_finite(i.v.x) | not_finite(i.v.y))
+		return ERROR_NAN;
+
+	// The periodic wrap in the drift can only move particles by one domain
+	// height, so y can be out of bounds as well
+	if ((i.r.x > G.width) | (i.r.x < 0) | (i.r.y > G.height) | (i.r.y < 0))
+		return ERROR_BOUNDARY;
+
+	return 0;
+}
+
+int check_particles(const grid &G, const particle_list &p, size_t &index)
+{
+	// First pass: branch-free scan over all particles, only accumulating
+	// whether anything went wrong at all
+	int bad = 0;
+
+#pragma omp parallel for reduction(| : bad)
+	for (size_t idx = 0; idx < p.size(); ++idx)
+	{
+		const particle &i = p[idx];
+		bad |= not_finite(i.r.x) | not_finite(i.r.y) | not_finite(i.v.x) | not_finite(i.v.y) |
+			   (i.r.x > G.width) | (i.r.x < 0) | (i.r.y > G.height) | (i.r.y < 0);
+	}
+
+	if (!bad)
+		return 0;
+
+	// Second pass, only done in case of failure: find the first offender
+	for (size_t idx = 0; idx < p.size(); ++idx)
+	{
+		int error = particle_error(G, p[idx]);
+		if (error)
+		{
+			index = idx;
+			return error;
+		}
+	}
+
+	return 0;
+}
+
+void report_particle(const particle_list &p, size_t index, size_t step, int check_interval, int error)
+{
+	const particle &i = p[index];
+
+	switch (error)
+	{
+	case ERROR_NAN:
+		cout << "NaN in variable occured" << endl;
+		break;
+	case ERROR_BOUNDARY:
+		cout << "Particle left boundary" << endl;
+		break;
+	case ERROR_HALO:
+		cout << "Particle moved too far for temporal_block" << endl;
+		break;
+	}
+
+	cout << "  step:     " << step << " (checked every " << check_interval << " steps)" << endl;
+	cout << "  particle: " << index << endl;
+	cout << "  position: " << i.r.x << ", " << i.r.y << endl;
+	cout << "  velocity: " << i.v.x << ", " << i.v.y << endl;
+	cout << "  force:    " << i.F.x << ", " << i.F.y << endl;
+}
+
+void dump_state(const particle_list &p, size_t step, const char *filename)
+{
+	ofstream out(filename);
+
+	if (!out)
+	{
+		cerr << "Could not open dump file " << filename << endl;
+		return;
+	}
+
+	out << "# step " << step << endl;
+	out << "# index x y vx vy Fx Fy" << endl;
+	out.precision(17);
+
+	for (size_t idx = 0; idx < p.size(); ++idx)
+	{
+		const particle &i = p[idx];
+		out << idx << " " << i.r.x << " " << i.r.y << " " << i.v.x << " " << i.v.y
+			<< " " << i.F.x << " " << i.F.y << endl;
+	}
+
+	cout << "State written to " << filename << endl;
+}
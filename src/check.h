@@ -0,0 +1,21 @@
+#pragma once
+
+#include "particle.h"
+#include "grid.h"
+
+// Error codes thrown by the integration loop
+const int ERROR_NAN = 100;      // NaN (or inf) in particle position or velocity
+const int ERROR_BOUNDARY = 200; // Particle left the simulation domain
+const int ERROR_HALO = 300;     // Particle outran the halo of its temporal block
+
+// Check all particles for violated invariants. Returns 0 if everything is
+// fine, or the error code of the first offending particle, whose index is
+// written to 'index'.
+int check_particles(const grid &G, const particle_list &p, size_t &index);
+
+// Print a description of a failed particle to the terminal. The particles
+// are checked every check_interval steps.
+void report_particle(const particle_list &p, size_t index, size_t step, int check_interval, int error);
+
+// Write the complete particle state to a text file
+void dump_state(const particle_list &p, size_t step, const char *filename);
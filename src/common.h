@@ -2,23 +2,16 @@
 
 #include <cstdlib>
 
-// Scalar is the floating point datatype for the sim 
+// Scalar is the floating point datatype for the sim
 typedef double scalar;
 
-// Global variables (initialized in gas.cpp)
-extern const size_t N;
+// Constants of the interaction, the same for every system
+// (initialized in parameters.cpp). Everything describing a particular
+// system lives in the parameters struct (parameters.h).
+
+// Maximum distance for force calculation
 extern const scalar box_cutoff;
+
+// Range parameter for Lennard-Jones-Potential
 extern const scalar pot_size;
 extern const scalar pot_size6;
-extern const scalar height;
-extern const scalar width;
-
-extern const int num_boxes_x;
-extern const int num_boxes_y;
-
-extern const int grid_h;
-extern const int grid_w;
-
-extern const scalar velocity_max;
-extern const scalar dt;
-extern const int num_boxes;
\ No newline at end of file
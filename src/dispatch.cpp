@@ -2,29 +2,35 @@
 #include "dispatch.h"
 #include "job.h"
 #include "Dispatcher.h"
+#include <algorithm>
 
 using namespace std;
 
-int coord2id(scalar x, scalar y)
+int coord2id(const grid &G, scalar x, scalar y)
 {
-    int box_x = int(x / box_cutoff);
-    int box_y = int(y / box_cutoff);
+    int box_x = int(x / G.box_size_x);
+    int box_y = int(y / G.box_size_y);
 
-    return box_x + box_y * num_boxes_x;
+    // Clamp to the domain, so that a particle that escaped (or turned NaN)
+    // can't corrupt memory before the invariant check reports it
+    box_x = min(max(box_x, 0), G.num_boxes_x - 1);
+    box_y = min(max(box_y, 0), G.num_boxes_y - 1);
+
+    return box_x + box_y * G.num_boxes_x;
 }
 
-int id_edge(int id)
+int id_edge(const grid &G, int id)
 {
-    if (id < num_boxes_x)
+    if (id < G.num_boxes_x)
         return 'T';
 
-    if (id >=  num_boxes_x * (num_boxes_y-1))
+    if (id >=  G.num_boxes_x * (G.num_boxes_y-1))
         return 'B';
 
-    if (id % num_boxes_x == 0)
+    if (id % G.num_boxes_x == 0)
         return 'L';
 
-    if (id % num_boxes_x == num_boxes_x - 1)
+    if (id % G.num_boxes_x == G.num_boxes_x - 1)
         return 'R';
 
     return '.';
@@ -1,4 +1,5 @@
 #pragma once
+#include "grid.h"
 
-int coord2id(scalar x, scalar y);
-int id_edge(int id);
\ No newline at end of file
+int coord2id(const grid &G, scalar x, scalar y);
+int id_edge(const grid &G, int id);
\ No newline at end of file
@@ -0,0 +1,91 @@
+#include <iostream>
+#include <ctime>
+#include <string>
+#include <fstream>
+#include "ensemble.h"
+#include "simulation.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+vector<ensemble_member> run_ensemble(const parameters &P, int members)
+{
+	vector<ensemble_member> result(members);
+
+	// All members need different seeds, so the clock is read only once
+	unsigned seed = P.seed ? P.seed : time(NULL);
+
+	// Members can take very different times (e.g. if one fails early), so
+	// they are handed out one by one
+#pragma omp parallel for schedule(dynamic, 1)
+	for (int k = 0; k < members; ++k)
+	{
+		// Parallel regions within the member run on this thread alone
+#ifdef _OPENMP
+		omp_set_num_threads(1);
+#endif
+
+		parameters Q = P;
+		Q.seed = seed + k;
+
+		// With a single thread there is nothing to gain from the strips
+		Q.use_numa_layout = false;
+
+		if (!Q.dump_file.empty())
+			Q.dump_file += "." + to_string(k);
+		Q.rdf_file += "." + to_string(k);
+		Q.field_file += "." + to_string(k);
+
+		ensemble_member &M = result[k];
+		M.seed = Q.seed;
+
+		try
+		{
+			Simulation S(Q);
+
+			try
+			{
+				while (S.T < Q.T_end)
+					S.step();
+			}
+			catch (int e)
+			{
+				M.error = e;
+
+#pragma omp critical(ensemble_output)
+				{
+					cout << "Ensemble member " << k << " failed:" << endl;
+					S.report(e);
+				}
+			}
+
+			// All samples of g(r) go into one data set
+			if (S.rdf.samples > 0)
+			{
+				ofstream rdf_out(Q.rdf_file);
+				write_rdf(S.rdf, S.G, S.T, rdf_out);
+			}
+
+			if (S.fields.samples > 0)
+			{
+				ofstream field_out(Q.field_file);
+				write_fields(S.fields, S.T, field_out);
+			}
+
+			M.steps = S.steps;
+			M.T = S.T;
+			M.kinetic_energy = S.kinetic_energy();
+			M.max_speed = S.max_speed();
+		}
+		catch (int e)
+		{
+			// The system could not be set up at all
+			M.error = e;
+		}
+	}
+
+	return result;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <vector>
+#include "common.h"
+#include "parameters.h"
+
+using namespace std;
+
+// Ensemble mode: many independent (small) systems are simulated side by
+// side, each of them serially on a thread of its own. Small systems don't
+// gain anything from parallelizing the force calculation (see
+// measurements.txt), but a sweep over many of them scales with the number
+// of cores this way.
+
+// Outcome of one member of an ensemble
+struct ensemble_member
+{
+	// Seed of the initial velocities
+	unsigned seed = 0;
+
+	// 0 if the member reached T_end, the error code (check.h, Dispatcher.h)
+	// otherwise
+	int error = 0;
+
+	// State at the end of the run
+	size_t steps = 0;
+	scalar T = 0;
+	scalar kinetic_energy = 0;
+	scalar max_speed = 0;
+};
+
+// Run 'members' systems with the parameters P until P.T_end. The members
+// only differ in their seed, member k gets P.seed + k. A failing member
+// doesn't stop the others, its dump file (if any) gets the member number
+// appended.
+vector<ensemble_member> run_ensemble(const parameters &P, int members);
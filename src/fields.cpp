@@ -0,0 +1,64 @@
+#include "fields.h"
+
+using namespace std;
+
+coarse_fields::coarse_fields(scalar width, scalar height, int cells_x, int cells_y)
+{
+	nx = cells_x;
+	ny = cells_y;
+	cell_x = width / nx;
+	cell_y = height / ny;
+	clear();
+}
+
+void coarse_fields::merge(const coarse_fields &F)
+{
+	for (int c = 0; c < nx * ny; ++c)
+	{
+		count[c] += F.count[c];
+		vx[c] += F.vx[c];
+		vy[c] += F.vy[c];
+		v2[c] += F.v2[c];
+	}
+
+	samples += F.samples;
+}
+
+void coarse_fields::clear()
+{
+	count.assign(nx * ny, 0);
+	vx.assign(nx * ny, 0);
+	vy.assign(nx * ny, 0);
+	v2.assign(nx * ny, 0);
+	samples = 0;
+}
+
+void write_fields(const coarse_fields &F, scalar time, ostream &out)
+{
+	out << "# time " << time << ", " << F.samples << " samples" << endl;
+	out << "# x y density vx vy temperature" << endl;
+
+	for (int cy = 0; cy < F.ny; ++cy)
+	{
+		for (int cx = 0; cx < F.nx; ++cx)
+		{
+			int c = cx + cy * F.nx;
+			scalar n = F.count[c];
+
+			scalar density = F.samples ? n / (F.samples * F.cell_x * F.cell_y) : 0;
+			scalar ux = n > 0 ? F.vx[c] / n : 0;
+			scalar uy = n > 0 ? F.vy[c] / n : 0;
+
+			// Fluctuation around the mean velocity, shared by the two
+			// degrees of freedom
+			scalar temperature = n > 0 ? 0.5 * (F.v2[c] / n - ux * ux - uy * uy) : 0;
+
+			out << (cx + 0.5) * F.cell_x << " " << (cy + 0.5) * F.cell_y << " " << density << " " << ux << " "
+				<< uy << " " << temperature << endl;
+		}
+		out << endl;
+	}
+
+	// Two empty lines in total separate the data sets for gnuplot's 'index'
+	out << endl;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <vector>
+#include <ostream>
+#include <algorithm>
+#include "common.h"
+#include "particle.h"
+
+using namespace std;
+
+// COARSE GRAINED FIELDS
+// Density, mean velocity and kinetic temperature on a coarse grid of
+// nx * ny cells covering the domain. The particles are binned in the kick of
+// the sampling steps, the fields are written out and cleared at every
+// diagnostic output. Much smaller than dumping the trajectories.
+struct coarse_fields
+{
+	// Cells
+	int nx = 0;
+	int ny = 0;
+	scalar cell_x = 0;
+	scalar cell_y = 0;
+
+	// Sums over the particles of every cell and all samples: particle
+	// count, velocity and squared speed
+	vector<scalar> count;
+	vector<scalar> vx;
+	vector<scalar> vy;
+	vector<scalar> v2;
+
+	// Number of configurations sampled
+	size_t samples = 0;
+
+	coarse_fields() {}
+	coarse_fields(scalar width, scalar height, int nx, int ny);
+
+	// Cell of a position, like coord2id for the boxes
+	int cell(scalar x, scalar y) const
+	{
+		int cx = min(max(int(x / cell_x), 0), nx - 1);
+		int cy = min(max(int(y / cell_y), 0), ny - 1);
+		return cx + cy * nx;
+	}
+
+	// Add a particle to its cell
+	void add(const particle &i)
+	{
+		int c = cell(i.r.x, i.r.y);
+		count[c] += 1;
+		vx[c] += i.v.x;
+		vy[c] += i.v.y;
+		v2[c] += i.v.x * i.v.x + i.v.y * i.v.y;
+	}
+
+	// Add the sums of other fields on the same grid
+	void merge(const coarse_fields &F);
+
+	// Forget all samples
+	void clear();
+};
+
+// Write the fields averaged over the samples in F, one line
+// "x y density vx vy temperature" per cell (at the cell center), rows
+// separated by empty lines as gnuplot's splot expects them. Temperature is
+// the kinetic one in two dimensions with unit mass and k_B = 1.
+void write_fields(const coarse_fields &F, scalar time, ostream &out);
@@ -2,67 +2,52 @@
 #include "vec.h"
 #include "common.h"
 #include <cmath>
+#include <chrono>
 #include "Dispatcher.h"
+#include "boundary.h"
 
 using namespace std;
-extern Dispatcher D;
+
 
 // Recalculate the forces acting on the particles.
 // Will backup the previous force to the pV member of the particles.
-void update_force(particle_list &p, vector<vector<int>> &box)
+void update_force(particle_list &p, vector<vector<int>> &box, Dispatcher &D, const Boundaries &B,
+				  force_kernel kernel, rdf_histogram *rdf, vector<job_tiles> *tiles)
 {
+	D.busy.resize(thread_count());
+	if (tiles)
+		tiles->resize(thread_count());
+
 	bool phases_left;
 #pragma omp parallel
 	{
-// Backup the force and calculate the wall repulsion
-// This loop will initialize the force!
-#pragma omp for
-		for (size_t idx = 0; idx < N; ++idx)
-		{
-			particle &i = p[idx];
-			i.pF = i.F;
-
-			// Distance to the nearest wall
-			scalar d;
-
-			// Force will only be applied if its within reach
-			bool within_reach = false;
-
-			// Direction of the force will be either +1 or -1
-			scalar force_direction = 0;
+		// Thread local tiles for the tiled kernel. They are reused for all
+		// jobs of this thread and only grow when a job needs more space.
+		job_tiles local;
+		job_tiles &T = tiles ? (*tiles)[thread_id()] : local;
 
-			// Check if we're near enough a wall
-			if (i.r.x < box_cutoff)
-			{
-				// Set distance
-				d = i.r.x;
+		// Thread private pair distance histogram on sampling steps, so the
+		// pair loops don't need to synchronize
+		rdf_histogram H;
+		if (rdf)
+			H = rdf_histogram(rdf->bins);
+		rdf_histogram *h = rdf ? &H : nullptr;
 
-				// Activate force calculation
-				within_reach = true;
+		int thread = thread_id();
+		int threads = team_size();
 
-				// Set direction of the force
-				force_direction = 1;
-			}
-			else if (i.r.x > width - box_cutoff)
-			{
-				// Distance to wall must be a positive number
-				d = width - i.r.x;
-				within_reach = true;
-				force_direction = -1;
-			}
+		// A team of one (e.g. a member of an ensemble, see ensemble.h)
+		// doesn't need to lock the dispatcher. The critical section below
+		// is global to the process and would serialize all ensemble members.
+		bool locked = team_size() > 1;
 
-			// Calculate the force if we're near enough
-			if (within_reach)
-			{
-				scalar F_wall = lennard_jones(d);
+		// Backup the force and initialize it with the wall forces. Only
+		// particles in the boxes along the walls are visited for the latter.
+		clear_force(p);
+		wall_force(p, box, B);
 
-				// Force is always perpendicular to the wall
-				i.F = vec(-F_wall * force_direction, 0);
-			}
-			// If no wall force is applied, init the force to zero
-			else
-				i.F = vec(0, 0);
-		}
+		// Skip the jobs of empty regions
+		D.compact(box);
 
 // Reset the dispatcher to the beginning
 #pragma omp master
@@ -70,107 +55,43 @@ void update_force(particle_list &p, vector<vector<int>> &box)
 			D.reset();
 		}
 #pragma omp barrier
+		// Time spent on jobs, without the waiting at the barriers
+		chrono::duration<double> busy(0);
+		chrono::steady_clock::time_point start;
+
 		do
 		{
+			if (D.timing)
+				start = chrono::steady_clock::now();
+
 			bool jobs_left = true;
 			while (jobs_left)
 			{
-				// Get a new job
-				job J;
+				// Get a chunk of neighboring jobs
+				int first = 0;
+				int last = 0;
 
+				if (locked)
+				{
 #pragma omp critical
+					jobs_left = D.get_next_chunk(thread, threads, first, last);
+				}
+				else
+					jobs_left = D.get_next_chunk(thread, threads, first, last);
+
+				for (int k = first; k < last; ++k)
 				{
-					if (D.jobs_available())
-					{
-						J = D.get_next_job();
-					}
+					const job &J = D.active_job(k);
+
+					if (kernel == KERNEL_TILED)
+						job_force_tiled(p, box, J, T, h);
 					else
-					{
-						jobs_left = false;
-					}
+						job_force_direct(p, box, J, h);
 				}
-				if (jobs_left)
-					for (auto i1 : box[J.origin])
-					{
-						for (auto i2 : box[J.origin])
-						{
-							if (i2 > i1)
-							{
-								// Displacement "vector" from p[i] to p[j]
-								scalar deltax = p[i1].r.x - p[i2].r.x;
-								scalar deltay = p[i1].r.y - p[i2].r.y;
-
-								// Periodic boundaries on north and south wall
-								// Check if the distance to a parallel transported "copy"
-								// of the second planet is shorter. We will only calculate
-								// the force to ONE SINGULAR version of the particle, assuming
-								// that the potential is always smaller than the domain
-								if (abs(p[i1].r.y - p[i2].r.y - height) < abs(deltay))
-									deltay = p[i1].r.y - p[i2].r.y - height;
-								else if (abs(p[i1].r.y - p[i2].r.y + height) < abs(deltay))
-									deltay = p[i1].r.y - p[i2].r.y + height;
-
-								// Make a numerical cheap check if the particles might be able
-								// to interact at all
-								if (abs(deltax) < box_cutoff && abs(deltay) < box_cutoff)
-								{
-									// The distance between the particles
-									scalar r = sqrt(deltax * deltax + deltay * deltay);
-
-									// Magnitude of the force
-									scalar F = lennard_jones(r);
-
-									// Project the force onto the x and y direction
-									scalar Fx = F * deltax / r;
-									scalar Fy = F * deltay / r;
-
-									// Add the forces to the two planets
-									p[i1].F += vec(-Fx, -Fy);
-									p[i2].F += vec(+Fx, +Fy);
-								}
-							}
-						}
-						for (auto id : J.id)
-						{
-							for (auto i2 : box[id])
-							{
-
-								// Displacement "vector" from p[i] to p[j]
-								scalar deltax = p[i1].r.x - p[i2].r.x;
-								scalar deltay = p[i1].r.y - p[i2].r.y;
-
-								// Periodic boundaries on north and south wall
-								// Check if the distance to a parallel transported "copy"
-								// of the second planet is shorter. We will only calculate
-								// the force to ONE SINGULAR version of the particle, assuming
-								// that the potential is always smaller than the domain
-								if (abs(p[i1].r.y - p[i2].r.y - height) < abs(deltay))
-									deltay = p[i1].r.y - p[i2].r.y - height;
-								else if (abs(p[i1].r.y - p[i2].r.y + height) < abs(deltay))
-									deltay = p[i1].r.y - p[i2].r.y + height;
-
-								// Make a numerical cheap check if the particles might be able
-								// to interact at all
-								if (abs(deltax) < box_cutoff && abs(deltay) < box_cutoff)
-								{
-									// The distance between the particles
-									scalar r = sqrt(deltax * deltax + deltay * deltay);
-
-									// Magnitude of the force
-									scalar F = lennard_jones(r);
-
-									// Project the force onto the x and y direction
-									scalar Fx = F * deltax / r;
-									scalar Fy = F * deltay / r;
-
-									// Add the forces to the two planets
-									p[i1].F += vec(-Fx, -Fy);
-									p[i2].F += vec(+Fx, +Fy);
-								}
-							}
-						}
-					}
-			} // End of while(D.jobs_available())
+			} // End of while(jobs_left)
+
+			if (D.timing)
+				busy += chrono::steady_clock::now() - start;
 
 #pragma omp barrier
 #pragma omp master
@@ -180,23 +101,239 @@ void update_force(particle_list &p, vector<vector<int>> &box)
 #pragma omp barrier
 
 		} while (phases_left);
+
+		if (D.timing)
+			D.busy[thread].seconds += busy.count();
+
+		if (rdf)
+		{
+#pragma omp critical(rdf_merge)
+			rdf->merge(H);
+		}
+	}
+
+	if (rdf)
+	{
+		rdf->samples++;
+		rdf->particles += p.size();
 	}
 }
 
-// A simple Lennard-Jones force, calculated by the distance parameter only
-// Strength is supplied by global variables. The force is cut off at a
-// certain distance.
-inline scalar lennard_jones(scalar d)
+// Calculate the pair forces of a job, working directly on the particle
+// list through the box ids
+void job_force_direct(particle_list &p, vector<vector<int>> &box, const job &J, rdf_histogram *H)
 {
-	// Cutoff distance
-	if (d < pot_size)
+	for (auto i1 : box[J.origin])
 	{
-		// Sixth power of the distance
-		scalar d6 = d * d * d * d * d * d;
-		return 6 * pot_size6 * (d6 - 2 * pot_size6) / (d6 * d6 * d);
+		for (auto i2 : box[J.origin])
+		{
+			if (J.self && i2 > i1)
+			{
+				// Displacement "vector" from p[i] to p[j]
+				scalar deltax = p[i1].r.x - p[i2].r.x;
+				scalar deltay = p[i1].r.y - p[i2].r.y;
+
+				// Particles of the same box are never further apart than a
+				// box size, so the periodic boundaries don't matter here
+
+				// Make a numerical cheap check if the particles might be able
+				// to interact at all
+				if (abs(deltax) < box_cutoff && abs(deltay) < box_cutoff)
+				{
+					// The distance between the particles
+					scalar r = sqrt(deltax * deltax + deltay * deltay);
+
+					// Magnitude of the force
+					scalar F = lennard_jones(r);
+
+					// Project the force onto the x and y direction
+					scalar Fx = F * deltax / r;
+					scalar Fy = F * deltay / r;
+
+					// Add the forces to the two planets
+					p[i1].F += vec(-Fx, -Fy);
+					p[i2].F += vec(+Fx, +Fy);
+
+					if (H)
+						H->add(r);
+				}
+			}
+		}
+		for (int k = 0; k < J.count; ++k)
+		{
+			// Periodic boundaries on north and south wall: boxes reached
+			// through the boundary are shifted by the job, so we work with
+			// the image of the particles right next to the origin box
+			scalar y1 = p[i1].r.y - J.shift[k];
+
+			for (auto i2 : box[J.id[k]])
+			{
+
+				// Displacement "vector" from p[i] to p[j]
+				scalar deltax = p[i1].r.x - p[i2].r.x;
+				scalar deltay = y1 - p[i2].r.y;
+
+				// Make a numerical cheap check if the particles might be able
+				// to interact at all
+				if (abs(deltax) < box_cutoff && abs(deltay) < box_cutoff)
+				{
+					// The distance between the particles
+					scalar r = sqrt(deltax * deltax + deltay * deltay);
+
+					// Magnitude of the force
+					scalar F = lennard_jones(r);
+
+					// Project the force onto the x and y direction
+					scalar Fx = F * deltax / r;
+					scalar Fy = F * deltay / r;
+
+					// Add the forces to the two planets
+					p[i1].F += vec(-Fx, -Fy);
+					p[i2].F += vec(+Fx, +Fy);
+
+					if (H)
+						H->add(r);
+				}
+			}
+		}
+	}
+}
+
+// Copy the positions of the particles of a box to the end of the tile
+// and zero their force accumulators. Positions are shifted by shift_y in
+// y direction, which places periodic images next to the origin box.
+void tile::gather(const particle_list &p, const vector<int> &ids, scalar shift_y)
+{
+	size_t offset = size;
+	resize(size + ids.size());
+
+	for (size_t k = 0; k < ids.size(); ++k)
+	{
+		const particle &i = p[ids[k]];
+		idx[offset + k] = ids[k];
+		x[offset + k] = i.r.x;
+		y[offset + k] = i.r.y + shift_y;
+		Fx[offset + k] = 0;
+		Fy[offset + k] = 0;
+	}
+}
+
+// Add the accumulated forces back to the particles
+void tile::scatter(particle_list &p) const
+{
+	for (size_t k = 0; k < size; ++k)
+	{
+		particle &i = p[idx[k]];
+		i.F.x += Fx[k];
+		i.F.y += Fy[k];
+	}
+}
+
+void tile::resize(size_t n)
+{
+	size = n;
+	if (idx.size() < n)
+	{
+		idx.resize(n);
+		x.resize(n);
+		y.resize(n);
+		Fx.resize(n);
+		Fy.resize(n);
 	}
-	else
-		return 0;
+}
+
+// Force between particle (xi, yi) and particle k of tile B, written without
+// branches so the loops over the tiles can be vectorized. The force on the
+// first particle is added to (Fxi, Fyi), the one on the second to B.
+static inline void tile_pair(scalar xi, scalar yi, scalar &Fxi, scalar &Fyi, tile &B, size_t k)
+{
+	// Displacement "vector" from the first to the second particle
+	scalar deltax = xi - B.x[k];
+	scalar deltay = yi - B.y[k];
+
+	// Lennard-Jones force, projected onto x and y. The projection is done
+	// with the squared distance, which saves the square root:
+	// F * delta / r = 6 pot_size6 (r^6 - 2 pot_size6) delta / r^14
+	scalar r2 = deltax * deltax + deltay * deltay;
+	scalar r6 = r2 * r2 * r2;
+	scalar F = 6 * pot_size6 * (r6 - 2 * pot_size6) / (r6 * r6 * r2);
+	F = r2 < pot_size * pot_size ? F : 0;
+
+	scalar Fx = F * deltax;
+	scalar Fy = F * deltay;
+
+	Fxi -= Fx;
+	Fyi -= Fy;
+	B.Fx[k] += Fx;
+	B.Fy[k] += Fy;
+}
+
+// Add the distances between particle (xi, yi) and particles [first, B.size)
+// of tile B to the histogram. Binning can't be vectorized, so this is a
+// separate loop over the tiles, only run on sampling steps.
+static void tile_distances(scalar xi, scalar yi, const tile &B, size_t first, rdf_histogram &H)
+{
+	for (size_t k = first; k < B.size; ++k)
+	{
+		scalar deltax = xi - B.x[k];
+		scalar deltay = yi - B.y[k];
+		H.add_squared(deltax * deltax + deltay * deltay);
+	}
+}
+
+// Calculate the pair forces of a job on local copies of its boxes. The
+// origin box and all neighbor boxes are gathered into two contiguous tiles,
+// all interactions are computed on the tiles, and the forces are written
+// back to the particle list once at the end.
+void job_force_tiled(particle_list &p, vector<vector<int>> &box, const job &J, job_tiles &T,
+					 rdf_histogram *H)
+{
+	tile &A = T.origin;
+	tile &B = T.neighbors;
+
+	A.resize(0);
+	A.gather(p, box[J.origin]);
+
+	// Nothing to do for empty boxes
+	if (A.size == 0)
+		return;
+
+	// The neighbor tile holds the shifted images of boxes behind the
+	// periodic boundary, so the pair loops don't need to care about it
+	B.resize(0);
+	for (int k = 0; k < J.count; ++k)
+		B.gather(p, box[J.id[k]], J.shift[k]);
+
+	for (size_t a = 0; a < A.size; ++a)
+	{
+		scalar xi = A.x[a];
+		scalar yi = A.y[a];
+		scalar Fxi = 0;
+		scalar Fyi = 0;
+
+		// Pairs within the origin box
+		size_t first = J.self ? a + 1 : A.size;
+#pragma omp simd reduction(+ : Fxi, Fyi)
+		for (size_t k = first; k < A.size; ++k)
+			tile_pair(xi, yi, Fxi, Fyi, A, k);
+
+		// Pairs with the neighbor boxes
+#pragma omp simd reduction(+ : Fxi, Fyi)
+		for (size_t k = 0; k < B.size; ++k)
+			tile_pair(xi, yi, Fxi, Fyi, B, k);
+
+		A.Fx[a] += Fxi;
+		A.Fy[a] += Fyi;
+
+		if (H)
+		{
+			tile_distances(xi, yi, A, first, *H);
+			tile_distances(xi, yi, B, 0, *H);
+		}
+	}
+
+	A.scatter(p);
+	B.scatter(p);
 }
 
 int next_origin(int i0, const vector<int> &box, job J)
@@ -214,7 +351,7 @@ int next_particle(int i0, const vector<int> &box, job J)
 	{
 		if (box[i] == J.origin)
 			return i;
-		for (int k = 0; k < int(J.id.size()); ++k)
+		for (int k = 0; k < J.count; ++k)
 			if (box[i] == J.id[k])
 				return i;
 	}
@@ -2,8 +2,91 @@
 
 #include "particle.h"
 #include "job.h"
+#include "common.h"
+#include "rdf.h"
+#include "allocator.h"
 
-void update_force(particle_list &p, vector<vector<int>> &box);
-inline scalar lennard_jones(scalar d);
+// Available implementations of the pair force calculation
+enum force_kernel
+{
+	KERNEL_DIRECT, // Work on the particle list through the box ids
+	KERNEL_TILED   // Gather the boxes of a job into local tiles first
+};
+
+// Contiguous local copy of the particles of one or more boxes
+// (structure of arrays), with local force accumulators.
+struct tile
+{
+	// Number of particles in the tile
+	size_t size = 0;
+
+	// Particle ids, for the scatter back to the particle list
+	vector<int> idx;
+
+	// Positions
+	vector<scalar, aligned_allocator<scalar>> x;
+	vector<scalar, aligned_allocator<scalar>> y;
+
+	// Accumulated forces
+	vector<scalar, aligned_allocator<scalar>> Fx;
+	vector<scalar, aligned_allocator<scalar>> Fy;
+
+	void gather(const particle_list &p, const vector<int> &ids, scalar shift_y = 0);
+	void scatter(particle_list &p) const;
+
+	// Set the size. Storage never shrinks, so a tile can be reused
+	// without allocations once it reached its working size.
+	void resize(size_t n);
+};
+
+struct Dispatcher;
+struct Boundaries;
+
+// Tiles needed to process one job
+struct job_tiles
+{
+	tile origin;
+	tile neighbors;
+};
+
+// Recalculate the forces of all particles, handing out the jobs of the
+// dispatcher D to the threads. Wall forces come from the walls B. If rdf is
+// given, the pair distances are added to it as one sample (see rdf.h).
+// The tiled kernel works in tiles[thread] if given, which keeps the tiles
+// at their working size from call to call, in temporary tiles otherwise.
+void update_force(particle_list &p, vector<vector<int>> &box, Dispatcher &D, const Boundaries &B,
+				  force_kernel kernel = KERNEL_TILED, rdf_histogram *rdf = nullptr, vector<job_tiles> *tiles = nullptr);
+void job_force_direct(particle_list &p, vector<vector<int>> &box, const job &J, rdf_histogram *H = nullptr);
+void job_force_tiled(particle_list &p, vector<vector<int>> &box, const job &J, job_tiles &T,
+					 rdf_histogram *H = nullptr);
 int next_origin(int i0, const vector<int> &box, job J);
-int next_particle(int i0, const vector<int> &box, job J);
\ No newline at end of file
+int next_particle(int i0, const vector<int> &box, job J);
+
+// A simple Lennard-Jones force, calculated by the distance parameter only
+// Strength is supplied by global variables. The force is cut off at a
+// certain distance.
+inline scalar lennard_jones(scalar d)
+{
+	// Cutoff distance
+	if (d < pot_size)
+	{
+		// Sixth power of the distance
+		scalar d6 = d * d * d * d * d * d;
+		return 6 * pot_size6 * (d6 - 2 * pot_size6) / (d6 * d6 * d);
+	}
+	else
+		return 0;
+}
+
+// Potential belonging to lennard_jones(d). It is zero at the cutoff, since
+// pot_size^6 = pot_size6.
+inline scalar lennard_jones_potential(scalar d)
+{
+	if (d < pot_size)
+	{
+		scalar d6 = d * d * d * d * d * d;
+		return pot_size6 * (pot_size6 / (d6 * d6) - 1 / d6);
+	}
+	else
+		return 0;
+}
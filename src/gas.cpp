@@ -5,13 +5,19 @@
 #include <fstream>
 #include <curses.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include "vec.h"
 #include "particle.h"
 #include "gui.h"
-#include "force.h"
-#include "Dispatcher.h"
-#include "dispatch.h"
 #include "common.h"
+#include "parameters.h"
+#include "simulation.h"
+#include "ensemble.h"
+#include "numa.h"
+#include "autotune.h"
+#include "metrics.h"
+#include "snapshot.h"
 
 using namespace std;
 
@@ -22,216 +28,215 @@ using namespace std;
 // Compiling with 'make gfx' will also set the variable.
 // #define USE_GUI
 
-// SYSTEM PARAMETERS
+// PROGRAM PARAMETERS
+// The parameters of the simulated system are in parameters.h, and can be
+// given on the command line, e.g. "./GAS N=400 grid_w=20 grid_h=20".
 
-// Particle count
-extern const size_t N = 100;
-
-// Step size for integration
-extern const scalar dt = 1e-6;
-
-// Information or screen refreshes come in these intervals
+// Information or screen refreshes come in these intervals (steps)
 #ifdef USE_GUI
-const scalar T_diag_max = 1 * dt;
+const size_t diag_interval = 1;
 #else
-const scalar T_diag_max = 1000 * dt;
+const size_t diag_interval = 1000;
 #endif
 
-// Maximum distance for force calculation
-// extern const scalar box_cutoff = 1.1225;
-extern const scalar box_cutoff = 2;
-
-// Range parameter for Lennard-Jones-Potential
-extern const scalar pot_size = 1 * pow(2, 1. / 6.);
-extern const scalar pot_size6 = 2; // pot_size^6
-
-// Domain size
-extern const scalar height = 5;
-extern const scalar width = 5;
-
-// Grid of initial positions
-extern const int grid_h = 10;
-extern const int grid_w = 10;
-
-// Maximum initial velocity
-extern const scalar velocity_max = 100;
-
-// Calculation box count (for parallelism)
-extern const int num_boxes_x = int(width / box_cutoff) + 1;
-extern const int num_boxes_y = int(height / box_cutoff) + 1;
-
-extern const int num_boxes = num_boxes_x * num_boxes_y;
-
-Dispatcher D;
-
-int main()
+// Integrate a single system until T_end, with diagnostic output
+static int run(Simulation &S)
 {
-	D = Dispatcher();
-
 #ifdef USE_GUI
 	// Initialize ncurses window
 	init_gui();
 #endif
 
-	// Seed the RNG
-	srand(time(NULL));
-
-	// Create a list of particles
-	// particle_list is a vector of particles
-	particle_list p(N);
-
-	// Create a list of ids that indicates in which box a particle is in.
-	vector<vector<int>> box(num_boxes);
-
-	// Init the particles
-	for (size_t i = 0; i < N; ++i)
+	// Radial distribution functions, one data set per diagnostic output
+	ofstream rdf_out;
+	if (S.P.rdf_interval > 0)
+		rdf_out.open(S.P.rdf_file);
+
+	// Coarse grained fields, likewise
+	ofstream field_out;
+	if (S.P.field_interval > 0)
+		field_out.open(S.P.field_file);
+
+	// Live metrics for the monitor, updated at every diagnostic output
+	metrics_publisher M;
+	if (S.P.publish_metrics && M.open(metrics_segment(getpid())))
+		cout << "Publishing metrics, watch with: ./GAS_monitor " << getpid() << endl;
+
+	// Particles for analysis programs, at every diagnostic output. The
+	// quadtree has at most roots + 3 splits per leaf_capacity + 1 particles
+	// and level of leaves.
+	snapshot_publisher E;
+	if (S.P.export_state)
 	{
-		// Velocity randomized, random speed and direction
-		scalar r_v = velocity_max * (scalar)rand() / RAND_MAX;
-		scalar r_phi = 2 * M_PI * (scalar)rand() / RAND_MAX;
-
-		// Set the random velocity
-		p[i].v = vec(sin(r_phi) * r_v, cos(r_phi) * r_v);
-
-		// Determine position on the grid
-		int pos_x = i % grid_w;
-		int pos_y = i / grid_w;
-
-		// Convert grid postion to physical position
-		// We stay away from the repulsive walls (east and west) to
-		// not introduce more energy to the system
-		scalar x = scalar(pos_x) / scalar(grid_w) * (width - 2 * pot_size) + pot_size;
-		scalar y = scalar(pos_y) / scalar(grid_h + 1) * height;
-		// Set position
-		p[i].r = vec(x, y);
-
-		int id = coord2id(x, y);
+		const grid &C = S.P.adaptive ? S.Q.G : S.G;
+		size_t cells = C.num_boxes;
+		if (S.P.adaptive)
+			cells += 3 * S.P.N * S.P.max_depth / (S.P.leaf_capacity + 1);
 
-		box[id].push_back(i);
+		if (E.open(snapshot_segment(getpid()), S.P.width, S.P.height, C.num_boxes_x, C.num_boxes_y, S.P.adaptive, S.P.N,
+				   cells))
+		{
+			cout << "Publishing the particles to /dev/shm" << snapshot_segment(getpid()) << endl;
+			E.publish(S.particles(), S.box, S.steps, S.time());
+		}
 	}
 
-	// Update the force once, so that the first verlet step
-	// has something to work with
-	update_force(p, box);
-
-	// Physical time, increased by the simulation loop
-	scalar T = 0;
+	auto last_update = chrono::steady_clock::now();
+	size_t last_steps = S.steps;
 
-	// Diagnostic time
-	// After this timer reached a certain value (T_diag_max),
-	// diagnostic information or screen redraws will be issued
-	// and the timer will be reset.
-	scalar T_diag = 0;
+#ifndef USE_GUI
+	// Total energy at the start, for the drift of the integrator
+	auto start = last_update;
+	scalar E0 = S.P.report_energy ? S.kinetic_energy() + S.potential_energy() : 0;
+#endif
 
 	// #### VERLET INTEGRATION ####
-	// We wrap the integration into a try catch block so we can throw some
-	// error codes.
-	// Currently checked:
+	// The integration is wrapped into a try catch block, so it can throw
+	// some error codes (see check.h).
+	// Currently checked (every check_interval steps):
 	//				- particle tunneling through west or east walls
-	//				- NaN values in particle position
+	//				- NaN values in particle position or velocity
 	try
 	{
 		// Integrate until the system reaches a desired time
-		while (T < 10)
+		while (S.time() < S.P.T_end)
 		{
-			// Is it time for a screen refresh again?
-			if (T_diag > T_diag_max)
+			// Stop at the first step at or past T_end, like the step by
+			// step loop of the ensemble does. The last chunk may end up to
+			// one dt after T_end (plus the rounding of the time).
+			scalar steps_left = ceil((S.P.T_end - S.time()) / S.P.dt);
+			S.step(min(diag_interval, size_t(steps_left)));
+
+			if (S.rdf.samples > 0)
 			{
-				// Reset diagnostic timer
-				T_diag = 0;
+				write_rdf(S.rdf, S.G, S.time(), rdf_out);
+				S.rdf.clear();
+			}
 
-#ifdef USE_GUI
-				// Draw the particles to the screen
-				draw_particles(p);
+			if (S.fields.samples > 0)
+			{
+				write_fields(S.fields, S.time(), field_out);
+				S.fields.clear();
+			}
 
-				// Update the screen
-				refresh();
+			if (M.block)
+			{
+				auto now = chrono::steady_clock::now();
+				chrono::duration<double> elapsed = now - last_update;
+
+				metrics m;
+				m.pid = getpid();
+				m.particles = S.particles().size();
+				m.threads = thread_count();
+				m.steps = S.steps;
+				m.time = S.time();
+				m.step_rate = (S.steps - last_steps) / elapsed.count();
+				m.kinetic_energy = S.kinetic_energy();
+				m.max_speed = S.max_speed();
+				m.imbalance = S.D.take_imbalance();
+				M.publish(m);
+
+				last_update = now;
+				last_steps = S.steps;
+			}
 
-				// Wait for a little bit, to keep fps to peasant levels
-				usleep(10000);
-#endif
+			if (E.header)
+				E.publish(S.particles(), S.box, S.steps, S.time());
 
-#ifndef USE_GUI
-				// Output current time to the terminal
-				cout << "simulation time: " << T << endl;
-#endif
-			}
+#ifdef USE_GUI
+			// Draw the particles to the screen
+			draw_particles(S.G, S.particles());
 
-			// Remove old ids
-			// #pragma omp parallel for
-			for (int i = 0; i < num_boxes; ++i)
-				box[i].clear();
+			// Update the screen
+			refresh();
 
-			// Step 1: Update all particle positions (drift)
-			// #pragma omp parallel for
-			for (size_t part = 0; part < p.size(); ++part)
-			{
-				particle &i = p[part];
-				// Drift
-				i.r += dt * i.v + 0.5 * dt * dt * i.F;
-
-				// Update the boxes
-				// #pragma omp critical
-				{
-					box[coord2id(i.r.x, i.r.y)].push_back(part);
-				}
-				// Test for NaN in the position
-				if (isnan(i.r.y) || isnan(i.r.x))
-					throw 100; // Error code for NaN
-
-				// Periodic boundary: Move the particle back
-				// to the simulation domain. This can not handle
-				// particles that move multiple domain heights in
-				// one step (although that would probably break the
-				// simulation anyways)
-				if (i.r.y < 0)
-					i.r.y += height;
-				else if (i.r.y > height)
-					i.r.y -= height;
-
-				// Check if the particle left the domain through the
-				// east or west boundary
-				if (i.r.x > width || i.r.x < 0)
-					throw 200; // Error code for leaving the area
-			}
+			// Wait for a little bit, to keep fps to peasant levels
+			usleep(10000);
+#endif
 
-			// Step 2: Update particle forces
-			update_force(p, box);
+#ifndef USE_GUI
+			// Output current time to the terminal
+			cout << "simulation time: " << S.time() << endl;
 
-			// Step 3: Update the particles' velocities (kick)
-			// pF denotes the force from the last step, prior
-			// to the force update
-			// #pragma omp parallel for
-			for (size_t part = 0; part < p.size(); ++part)
+			if (S.P.report_energy)
 			{
-				particle &i = p[part];
-				i.v += 0.5 * dt * (i.F + i.pF);
+				scalar E = S.kinetic_energy() + S.potential_energy();
+				chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+				cout << "energy: " << E << ", relative drift " << (E - E0) / max(abs(E0), scalar(1)) << " after "
+					 << elapsed.count() << " s" << endl;
 			}
-			// Update the timers
-			T += dt;
-			T_diag += dt;
+#endif
 		}
 	}
 
 	// Catch thrown errors and inform the user about what happened.
 	catch (int e)
 	{
-		switch (e)
-		{
-		case 100:
-		{
-			endwin();
-			cout << "NaN in variable occured" << endl;
-		}
-		case 200:
-		{
-			endwin();
-			cout << "Particle left boundary" << endl;
-		}
-		}
+#ifdef USE_GUI
+		endwin();
+#endif
+		S.report(e);
+		return e;
 	}
 #ifdef USE_GUI
 	// Terminate the curses window
 	endwin();
 #endif
-}
\ No newline at end of file
+
+	return 0;
+}
+
+// Run an ensemble of systems (ensemble=<count> on the command line) and
+// print a line per member
+static int ensemble_main(const parameters &P)
+{
+	vector<ensemble_member> members = run_ensemble(P, P.ensemble);
+
+	int failures = 0;
+	cout << "# member seed steps time kinetic_energy max_speed error" << endl;
+	for (size_t k = 0; k < members.size(); ++k)
+	{
+		const ensemble_member &M = members[k];
+		cout << k << " " << M.seed << " " << M.steps << " " << M.T << " " << M.kinetic_energy << " "
+			 << M.max_speed << " " << M.error << endl;
+		failures += M.error != 0;
+	}
+
+	if (failures)
+		cout << failures << " of " << members.size() << " members failed" << endl;
+
+	return failures ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	parameters P;
+	if (!parse_parameters(argc, argv, P))
+		return 1;
+
+	// Calibration runs for the fastest settings. An ensemble runs every
+	// member on a single thread anyways.
+	if (P.autotune && P.ensemble == 0)
+		autotune(P, cout);
+
+	if (P.threads > 0)
+		set_thread_count(P.threads);
+
+	// Pin the team of the final size
+	if (P.pin_threads)
+		pin_threads();
+
+	if (P.ensemble > 0)
+		return ensemble_main(P);
+
+	// Set up the system, this fails for domains the box grid can't cover
+	try
+	{
+		Simulation S(P);
+		return run(S);
+	}
+	catch (int e)
+	{
+		return e;
+	}
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <algorithm>
+#include "common.h"
+
+using namespace std;
+
+// The domain and its calculation boxes. Every box interacts with all boxes
+// within box_cutoff (see Dispatcher.h).
+struct grid
+{
+	// Domain size
+	scalar width = 0;
+	scalar height = 0;
+
+	// Number of calculation boxes per cutoff length (see parameters.h)
+	int box_subdivision = 1;
+
+	// Calculation box count
+	int num_boxes_x = 1;
+	int num_boxes_y = 1;
+	int num_boxes = 1;
+
+	// Actual box size. The boxes are stretched a little so they tile the
+	// domain exactly, which keeps the north/south periodicity aligned with
+	// the grid.
+	scalar box_size_x = 0;
+	scalar box_size_y = 0;
+
+	grid() {}
+
+	grid(scalar w, scalar h, int subdivision)
+	{
+		width = w;
+		height = h;
+		box_subdivision = subdivision;
+
+		// Boxes are (at least) box_cutoff / box_subdivision wide
+		num_boxes_x = max(int(width / (box_cutoff / box_subdivision)), 1);
+		num_boxes_y = max(int(height / (box_cutoff / box_subdivision)), 1);
+		num_boxes = num_boxes_x * num_boxes_y;
+
+		box_size_x = width / num_boxes_x;
+		box_size_y = height / num_boxes_y;
+	}
+};
@@ -30,7 +30,7 @@ void init_gui()
 	attron(A_BOLD);
 }
 
-void draw_particles(const particle_list &p)
+void draw_particles(const grid &G, const particle_list &p)
 {
 	// Get screen size
 	int screen_x, screen_y;
@@ -39,8 +39,8 @@ void draw_particles(const particle_list &p)
 	for (auto i : p)
 	{
 
-		double x_rel = i.r.x / width; // Relative position according to fov
-		double y_rel = i.r.y / height;
+		double x_rel = i.r.x / G.width; // Relative position according to fov
+		double y_rel = i.r.y / G.height;
 
 		int pos_x = x_rel * screen_x;
 		int pos_y = y_rel * screen_y;
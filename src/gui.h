@@ -1,6 +1,7 @@
 #pragma once
 #include "vec.h"
 #include "particle.h"
+#include "grid.h"
 
 void init_gui();
-void draw_particles(const particle_list &p);
\ No newline at end of file
+void draw_particles(const grid &G, const particle_list &p);
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include <cmath>
+#include "integrator.h"
+
+using namespace std;
+
+splitting scheme_splitting(integrator_scheme scheme)
+{
+	if (scheme == INTEGRATOR_OMELYAN)
+	{
+		// I. P. Omelyan, I. M. Mryglod, R. Folk, Comput. Phys. Commun. 146,
+		// 188 (2002), velocity form
+		const scalar lambda = 0.1931833275037836;
+		return {2, {lambda, 1 - 2 * lambda, lambda}, {0.5, 0.5}};
+	}
+
+	if (scheme == INTEGRATOR_FOREST_RUTH)
+	{
+		// E. Forest, R. D. Ruth, Physica D 43, 105 (1990), velocity form.
+		// The middle drift goes backwards.
+		const scalar theta = 1 / (2 - cbrt(2.));
+		return {3, {theta / 2, (1 - theta) / 2, (1 - theta) / 2, theta / 2}, {theta, 1 - 2 * theta, theta}};
+	}
+
+	return {1, {0.5, 0.5}, {1}};
+}
+
+const char *scheme_name(integrator_scheme scheme)
+{
+	switch (scheme)
+	{
+	case INTEGRATOR_OMELYAN:
+		return "omelyan";
+	case INTEGRATOR_FOREST_RUTH:
+		return "forest_ruth";
+	case INTEGRATOR_RESPA:
+		return "respa";
+	default:
+		return "verlet";
+	}
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "common.h"
+
+// TIME INTEGRATION
+// All schemes are symplectic, so the energy doesn't drift away but only
+// fluctuates, with an amplitude that shrinks with dt at the order of the
+// scheme. Higher orders allow larger steps for the same accuracy, at more
+// force calculations per step (report_energy=1 shows which pays off).
+enum integrator_scheme
+{
+	// Velocity verlet, second order, one force calculation per step
+	INTEGRATOR_VERLET,
+
+	// Omelyan's second order scheme of minimal error, two force
+	// calculations per step. For smooth forces (a harmonic oscillator) its
+	// energy error is about 100 times smaller than that of verlet with the
+	// same dt, and 25 times smaller than two verlet steps of dt / 2. The
+	// jumps of the force at the cutoff leave a factor of about 2.5 at the
+	// same dt (integrator_drift in validate.cpp).
+	INTEGRATOR_OMELYAN,
+
+	// Forest-Ruth, fourth order, three force calculations per step
+	INTEGRATOR_FOREST_RUTH,
+
+	// Multiple time steps (r-RESPA): velocity verlet for the pair forces,
+	// with respa_substeps verlet substeps of the cheap but stiff wall
+	// forces in between. One pair force calculation per step.
+	INTEGRATOR_RESPA
+};
+
+// A splitting of a step into kicks (v += kick[k] dt F) and drifts
+// (r += drift[k] dt v): kick[0], drift[0], forces, kick[1], drift[1],
+// forces, ..., kick[stages]. The forces at the end of a step are the ones
+// at the beginning of the next.
+struct splitting
+{
+	int stages;
+	scalar kick[4];
+	scalar drift[3];
+};
+
+// Splitting of the single rate schemes (all but INTEGRATOR_RESPA, which
+// splits the forces instead)
+splitting scheme_splitting(integrator_scheme scheme);
+
+// Name of a scheme on the command line
+const char *scheme_name(integrator_scheme scheme);
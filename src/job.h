@@ -1,19 +1,74 @@
 #pragma once
-#include <vector>
+#include <type_traits>
+#include "common.h"
 
 using namespace std;
 
+// Largest number of boxes a job can interact with. The half-shell stencils
+// of box subdivisions up to 3 fit into a single job. Larger neighborhoods
+// are split over several jobs with the same origin, which have to run in
+// different phases.
+const int job_capacity = 24;
+
+// A job is a plain value without any heap storage, so handing it out is a
+// simple copy, and the loops over its boxes have a bound known at compile
+// time.
 struct job
 {
     // Center cell that is the origin of all calculations
-    int origin;
+    int origin = 0;
+
+    // Whether the pairs within the origin box belong to this job. Only the
+    // first of several jobs of the same origin has it set.
+    bool self = true;
+
+    // Number of boxes that interact with the origin
+    int count = 0;
 
     // Boxes that interact with the origin.
-    vector<int> id;
+    int id[job_capacity];
+
+    // Shift in y direction that has to be added to the positions of the
+    // particles in box id[k] to get their periodic image next to the origin.
+    // Zero for all boxes that are not reached through the north/south
+    // boundary.
+    scalar shift[job_capacity];
+
+    bool full() const
+    {
+        return count == job_capacity;
+    }
 
-    // Insert a box to this job
-    void add_id(int new_id)
+    // Insert a box to this job, which must not be full
+    void add_id(int new_id, scalar new_shift = 0)
     {
-        id.push_back(new_id);
+        id[count] = new_id;
+        shift[count] = new_shift;
+        ++count;
     }
-};
\ No newline at end of file
+};
+
+static_assert(is_trivially_copyable<job>::value, "Jobs are copied around as plain values");
+
+// Split the neighbor list of an origin into jobs of at most job_capacity
+// boxes. The first job also gets the pairs within the origin.
+template <class Neighbors, class Emit>
+void split_jobs(int origin, const Neighbors &neighbors, Emit emit)
+{
+    job J;
+    J.origin = origin;
+
+    int part = 0;
+    for (auto &n : neighbors)
+    {
+        if (J.full())
+        {
+            emit(J, part++);
+            J.self = false;
+            J.count = 0;
+        }
+        J.add_id(n.first, n.second);
+    }
+
+    emit(J, part);
+}
@@ -0,0 +1,125 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <new>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mapped.h"
+
+using namespace std;
+
+void *map_file(const char *directory, size_t bytes)
+{
+	if (bytes == 0)
+		return nullptr;
+
+	string path = string(directory) + "/gas_particles.XXXXXX";
+	vector<char> name(path.begin(), path.end());
+	name.push_back(0);
+
+	int fd = mkstemp(name.data());
+	if (fd < 0)
+	{
+		cerr << "Can't create a particle file in " << directory << ": " << strerror(errno) << endl;
+		throw bad_alloc();
+	}
+
+	// Nobody else needs the name
+	unlink(name.data());
+
+	void *memory = MAP_FAILED;
+	if (ftruncate(fd, bytes) == 0)
+		memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	// The mapping keeps the file alive
+	close(fd);
+
+	if (memory == MAP_FAILED)
+	{
+		cerr << "Can't map a particle file of " << bytes << " bytes in " << directory << ": " << strerror(errno)
+			 << endl;
+		throw bad_alloc();
+	}
+
+	// The sweeps read and write the lists front to back
+	madvise(memory, bytes, MADV_SEQUENTIAL);
+
+	return memory;
+}
+
+void unmap_file(void *memory, size_t bytes)
+{
+	if (memory)
+		munmap(memory, bytes);
+}
+
+void prefetch(const void *begin, size_t bytes)
+{
+	if (bytes == 0)
+		return;
+
+	// madvise wants whole pages
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t first = uintptr_t(begin) / page * page;
+	uintptr_t last = uintptr_t(begin) + bytes;
+
+	madvise((void *)first, last - first, MADV_WILLNEED);
+}
+
+void *allocate_block(size_t bytes)
+{
+	if (bytes == 0)
+		return nullptr;
+
+	// Small blocks from the heap, at cache line boundaries
+	if (bytes < huge_page_size)
+	{
+		void *memory = nullptr;
+		if (posix_memalign(&memory, 64, bytes) != 0)
+			throw bad_alloc();
+		return memory;
+	}
+
+	size_t size = (bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+
+	// Explicit huge pages, if the pool has enough of them
+	void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (21 << MAP_HUGE_SHIFT), -1, 0);
+	if (memory != MAP_FAILED)
+		return memory;
+
+	// Ordinary pages, aligned to a huge page so the kernel can back all of
+	// it with transparent huge pages. One huge page more is mapped, and the
+	// unaligned ends are returned.
+	char *start = static_cast<char *>(
+		mmap(nullptr, size + huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (start == MAP_FAILED)
+		throw bad_alloc();
+
+	char *aligned = reinterpret_cast<char *>((uintptr_t(start) + huge_page_size - 1) / huge_page_size * huge_page_size);
+	if (aligned > start)
+		munmap(start, aligned - start);
+	munmap(aligned + size, start + huge_page_size - aligned);
+
+#ifdef MADV_HUGEPAGE
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+
+	return aligned;
+}
+
+void free_block(void *memory, size_t bytes)
+{
+	if (!memory)
+		return;
+
+	if (bytes < huge_page_size)
+		free(memory);
+	else
+		munmap(memory, (bytes + huge_page_size - 1) / huge_page_size * huge_page_size);
+}
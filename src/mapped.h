@@ -0,0 +1,38 @@
+#pragma once
+#include <cstddef>
+
+// OUT OF CORE STORAGE
+// Particle lists larger than the memory of the node live in files instead
+// (see first_touch_allocator and parameters::out_of_core_dir). The files
+// are mapped into memory, the kernel pages them in and out as the sweeps
+// stream through them (see Simulation::sweep).
+
+// Map a new file of 'bytes' bytes in 'directory'. The file is unlinked
+// right away, so it disappears with the mapping (or the process). Throws
+// bad_alloc if the file can't be created.
+void *map_file(const char *directory, size_t bytes);
+
+// Unmap a mapping of map_file
+void unmap_file(void *memory, size_t bytes);
+
+// Ask the kernel to start reading a range of a mapping in the background
+void prefetch(const void *begin, size_t bytes);
+
+// LARGE BLOCKS
+// Particle lists and the scratch arrays of the kernels are allocated in
+// blocks aligned to cache lines. Blocks of a huge page (2 MiB) or more are
+// mapped directly and backed by huge pages, which saves most of the TLB
+// misses of walking gigabytes of particles: explicit huge pages if the
+// system reserved some (vm.nr_hugepages), otherwise transparent huge pages
+// if the kernel has them, otherwise ordinary pages. Either way the memory
+// is untouched until first written, like any other mapping.
+
+// Size of the huge pages used
+const size_t huge_page_size = size_t(2) << 20;
+
+// Allocate 'bytes' bytes aligned to at least 64 bytes. Throws bad_alloc if
+// there is no memory left.
+void *allocate_block(size_t bytes);
+
+// Free a block of allocate_block, of the same size
+void free_block(void *memory, size_t bytes);
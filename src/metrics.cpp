@@ -0,0 +1,110 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "metrics.h"
+
+using namespace std;
+
+string metrics_segment(int64_t pid)
+{
+	return "/gas_metrics." + to_string(pid);
+}
+
+bool metrics_publisher::open(const string &segment)
+{
+	close();
+
+	int fd = shm_open(segment.c_str(), O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		cerr << "Can't create the metrics segment " << segment << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	void *memory = MAP_FAILED;
+	if (ftruncate(fd, sizeof(metrics_block)) == 0)
+		memory = mmap(nullptr, sizeof(metrics_block), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	// The mapping stays valid without the descriptor
+	::close(fd);
+
+	if (memory == MAP_FAILED)
+	{
+		cerr << "Can't map the metrics segment " << segment << ": " << strerror(errno) << endl;
+		shm_unlink(segment.c_str());
+		return false;
+	}
+
+	block = ::new (memory) metrics_block();
+	block->sequence.store(0);
+	name = segment;
+
+	return true;
+}
+
+void metrics_publisher::publish(const metrics &m)
+{
+	if (!block)
+		return;
+
+	// Odd sequence: readers know their copy may be torn
+	uint64_t s = block->sequence.load(memory_order_relaxed);
+	block->sequence.store(s + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	block->values = m;
+
+	block->sequence.store(s + 2, memory_order_release);
+}
+
+void metrics_publisher::close()
+{
+	if (!block)
+		return;
+
+	munmap(block, sizeof(metrics_block));
+	shm_unlink(name.c_str());
+	block = nullptr;
+}
+
+const metrics_block *attach_metrics(const string &segment)
+{
+	int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return nullptr;
+
+	void *memory = mmap(nullptr, sizeof(metrics_block), PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (memory == MAP_FAILED)
+		return nullptr;
+
+	return static_cast<const metrics_block *>(memory);
+}
+
+metrics read_metrics(const metrics_block *block)
+{
+	metrics m;
+
+	while (true)
+	{
+		uint64_t before = block->sequence.load(memory_order_acquire);
+
+		if (before % 2 == 0)
+		{
+			m = block->values;
+			atomic_thread_fence(memory_order_acquire);
+
+			if (block->sequence.load(memory_order_relaxed) == before)
+				return m;
+		}
+
+		// The writer is in the middle of an update, which takes a couple of
+		// nanoseconds
+		usleep(1);
+	}
+}
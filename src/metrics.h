@@ -0,0 +1,81 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include "common.h"
+
+using namespace std;
+
+// LIVE METRICS
+// A running simulation publishes a few numbers at every diagnostic output
+// to a POSIX shared memory segment, where any number of readers (see
+// monitor.cpp) can look at them without disturbing the run. Updates use a
+// sequence lock: the writer never waits, readers retry if they caught an
+// update halfway.
+
+// The numbers published
+struct metrics
+{
+	// Process id of the simulation
+	int64_t pid = 0;
+
+	// Particle count and threads of the force calculation
+	int64_t particles = 0;
+	int64_t threads = 0;
+
+	// Steps done and physical time
+	int64_t steps = 0;
+	double time = 0;
+
+	// Steps per second of wall time since the last update
+	double step_rate = 0;
+
+	double kinetic_energy = 0;
+	double max_speed = 0;
+
+	// Time the busiest thread spent on pair force jobs, relative to the
+	// average of all threads, minus one. 0 is perfectly balanced.
+	double imbalance = 0;
+};
+
+// Layout of the shared memory segment
+struct metrics_block
+{
+	// Odd while an update is in progress
+	atomic<uint64_t> sequence;
+
+	metrics values;
+};
+
+// Name of the segment of a simulation, "/gas_metrics.<pid>"
+string metrics_segment(int64_t pid);
+
+// Writing side, owned by the simulation
+struct metrics_publisher
+{
+	metrics_block *block = nullptr;
+	string name;
+
+	// Create the segment. Returns false (after telling why) if that fails,
+	// publish() does nothing then.
+	bool open(const string &segment);
+
+	// Update the values. Only one thread may publish.
+	void publish(const metrics &m);
+
+	// Unmap and remove the segment
+	void close();
+
+	~metrics_publisher()
+	{
+		close();
+	}
+};
+
+// Reading side: map an existing segment read only. Returns nullptr if there
+// is none.
+const metrics_block *attach_metrics(const string &segment);
+
+// Take a consistent copy of the values, retrying while an update is in
+// progress
+metrics read_metrics(const metrics_block *block);
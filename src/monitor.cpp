@@ -0,0 +1,54 @@
+// Watch the live metrics of a running simulation (started with metrics=1)
+//
+//	./GAS_monitor <pid> [seconds between lines]
+//
+// Prints a line whenever the simulation published new values, until it
+// ends. Reading never blocks or slows down the simulation.
+
+#include <iostream>
+#include <cstdlib>
+#include <csignal>
+#include <unistd.h>
+#include "metrics.h"
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		cerr << "Usage: " << argv[0] << " <pid of the simulation> [seconds between lines]" << endl;
+		return 1;
+	}
+
+	int64_t pid = atoll(argv[1]);
+	double interval = argc > 2 ? atof(argv[2]) : 1;
+
+	const metrics_block *block = attach_metrics(metrics_segment(pid));
+	if (!block)
+	{
+		cerr << "No metrics of process " << pid << " (not running, or started without metrics=1)" << endl;
+		return 1;
+	}
+
+	cout << "# steps time steps/s kinetic_energy max_speed imbalance particles threads" << endl;
+
+	int64_t last_steps = -1;
+
+	// The mapping outlives the segment, so the process itself is watched
+	while (kill(pid, 0) == 0)
+	{
+		metrics m = read_metrics(block);
+
+		if (m.steps != last_steps)
+		{
+			cout << m.steps << " " << m.time << " " << m.step_rate << " " << m.kinetic_energy << " " << m.max_speed
+				 << " " << m.imbalance << " " << m.particles << " " << m.threads << endl;
+			last_steps = m.steps;
+		}
+
+		usleep(useconds_t(interval * 1e6));
+	}
+
+	return 0;
+}
@@ -0,0 +1,302 @@
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <sched.h>
+#include <dirent.h>
+#include <cstring>
+#include "numa.h"
+#include "dispatch.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+int thread_count()
+{
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+
+void set_thread_count(int n)
+{
+#ifdef _OPENMP
+	omp_set_num_threads(n);
+#endif
+}
+
+int thread_id()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+int team_size()
+{
+#ifdef _OPENMP
+	return omp_get_num_threads();
+#else
+	return 1;
+#endif
+}
+
+void thread_range(size_t n, int t, int T, size_t &begin, size_t &end)
+{
+	size_t chunk = n / T;
+	size_t rest = n % T;
+
+	// The first 'rest' threads get one item more
+	if (size_t(t) < rest)
+	{
+		begin = t * (chunk + 1);
+		end = begin + chunk + 1;
+	}
+	else
+	{
+		begin = t * chunk + rest;
+		end = begin + chunk;
+	}
+}
+
+void first_touch(particle_list &p, size_t first)
+{
+#pragma omp parallel for schedule(static)
+	for (size_t idx = first; idx < p.size(); ++idx)
+		::new ((void *)&p[idx]) particle();
+}
+
+// NUMA node of a core, read from sysfs. Returns 0 if the system doesn't
+// tell (e.g. no NUMA support at all)
+static int node_of_cpu(int cpu)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	int node = 0;
+	while (dirent *entry = readdir(dir))
+	{
+		if (strncmp(entry->d_name, "node", 4) == 0)
+		{
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+
+	closedir(dir);
+	return node;
+}
+
+int current_node()
+{
+	int cpu = sched_getcpu();
+	return cpu < 0 ? 0 : node_of_cpu(cpu);
+}
+
+void pin_threads()
+{
+	// Leave the affinity to the OpenMP runtime if the user asked for it
+	if (getenv("OMP_PROC_BIND") || getenv("OMP_PLACES"))
+		return;
+
+	// A single thread (e.g. the serial build) is left to the scheduler,
+	// concurrent runs would all end up on the first core
+	if (thread_count() < 2)
+		return;
+
+	// Cores we are allowed to run on, ordered by node
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+
+	vector<pair<int, int>> cores; // (node, cpu)
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+		if (CPU_ISSET(cpu, &allowed))
+			cores.push_back(make_pair(node_of_cpu(cpu), cpu));
+
+	if (cores.empty())
+		return;
+
+	sort(cores.begin(), cores.end());
+
+#pragma omp parallel
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cores[thread_id() % cores.size()].second, &set);
+
+		// pid 0 is the calling thread
+		if (sched_setaffinity(0, sizeof(set), &set) != 0)
+			cerr << "Could not pin thread " << thread_id() << endl;
+	}
+}
+
+void numa_layout::create(const grid &box_grid, particle_list &p)
+{
+	G = box_grid;
+	num_threads = thread_count();
+
+	// Count the particles per box column
+	vector<size_t> column_count(G.num_boxes_x, 0);
+	for (size_t idx = 0; idx < p.size(); ++idx)
+		column_count[coord2id(G, p[idx].r.x, p[idx].r.y) % G.num_boxes_x]++;
+
+	// Cut the columns into strips of about p.size() / num_threads particles
+	first_column.assign(num_threads + 1, G.num_boxes_x);
+	column_owner.assign(G.num_boxes_x, num_threads - 1);
+	first_column[0] = 0;
+
+	size_t sum = 0;
+	int t = 0;
+	for (int col = 0; col < G.num_boxes_x; ++col)
+	{
+		// Start the next strip, if this one is full
+		while (t < num_threads - 1 && sum >= (t + 1) * p.size() / num_threads)
+		{
+			t++;
+			first_column[t] = col;
+		}
+
+		column_owner[col] = t;
+		sum += column_count[col];
+	}
+
+	// Find out where the threads are running
+	thread_node.assign(num_threads, 0);
+#pragma omp parallel
+	{
+		thread_node[thread_id()] = current_node();
+	}
+
+	// Steal from the own node first, from the nearest strips first
+	steal_order.assign(num_threads, vector<int>());
+	for (int t = 0; t < num_threads; ++t)
+	{
+		for (int v = 0; v < num_threads; ++v)
+			steal_order[t].push_back(v);
+
+		auto distance = [&](int v) {
+			return make_pair(thread_node[v] != thread_node[t], abs(v - t));
+		};
+
+		std::sort(steal_order[t].begin(), steal_order[t].end(),
+				  [&](int a, int b) { return distance(a) < distance(b); });
+	}
+
+	// The buffer for sorting gets the same first touch as the particles
+	buffer.resize(p.size());
+	first_touch(buffer);
+
+	strays.assign(num_threads, vector<int>());
+	first_particle.assign(num_threads + 1, 0);
+
+	sort(p);
+}
+
+int numa_layout::strip_of(scalar x) const
+{
+	return column_owner[coord2id(G, x, 0) % G.num_boxes_x];
+}
+
+void numa_layout::sort(particle_list &p)
+{
+	int T = num_threads;
+
+	// Particles might have been removed since the last sort
+	buffer.resize(p.size());
+
+	// Number of particles per (thread, strip)
+	strip_count.assign(T * T, 0);
+	size_t *count = strip_count.data();
+
+	// The runtime may give us fewer than T threads, every thread then does
+	// the ranges of several
+#pragma omp parallel num_threads(T)
+	{
+		for (int t = thread_id(); t < T; t += team_size())
+		{
+			size_t begin, end;
+			thread_range(p.size(), t, T, begin, end);
+
+			for (size_t idx = begin; idx < end; ++idx)
+				count[t * T + strip_of(p[idx].r.x)]++;
+		}
+
+#pragma omp barrier
+#pragma omp single
+		{
+			// Turn the counts into the positions where every thread writes
+			// the particles of every strip
+			size_t offset = 0;
+			for (int s = 0; s < T; ++s)
+			{
+				first_particle[s] = offset;
+				for (int u = 0; u < T; ++u)
+				{
+					size_t n = count[u * T + s];
+					count[u * T + s] = offset;
+					offset += n;
+				}
+			}
+			first_particle[T] = offset;
+		}
+
+		// Most particles are copied to memory of the own node, only the ones
+		// that changed strip since the last sort go somewhere else
+		for (int t = thread_id(); t < T; t += team_size())
+		{
+			size_t begin, end;
+			thread_range(p.size(), t, T, begin, end);
+
+			for (size_t idx = begin; idx < end; ++idx)
+				buffer[count[t * T + strip_of(p[idx].r.x)]++] = p[idx];
+		}
+	}
+
+	swap(p, buffer);
+}
+
+void numa_layout::rebin(const particle_list &p, vector<vector<int>> &box)
+{
+	int T = num_threads;
+
+	// Every thread does the strips of the missing ones if the runtime gives
+	// us fewer than T
+#pragma omp parallel num_threads(T)
+	for (int t = thread_id(); t < T; t += team_size())
+	{
+		// Clear the boxes of the strip
+		for (int y = 0; y < G.num_boxes_y; ++y)
+			for (int x = first_column[t]; x < first_column[t + 1]; ++x)
+				box[x + y * G.num_boxes_x].clear();
+
+		strays[t].clear();
+
+		// Particles that left the strip since the last sort are handled
+		// afterwards, since their boxes belong to another strip
+		for (size_t idx = first_particle[t]; idx < first_particle[t + 1]; ++idx)
+		{
+			int id = coord2id(G, p[idx].r.x, p[idx].r.y);
+
+			if (column_owner[id % G.num_boxes_x] == t)
+				box[id].push_back(idx);
+			else
+				strays[t].push_back(idx);
+		}
+	}
+
+	for (int t = 0; t < T; ++t)
+		for (auto idx : strays[t])
+			box[coord2id(G, p[idx].r.x, p[idx].r.y)].push_back(idx);
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <vector>
+#include "common.h"
+#include "particle.h"
+#include "grid.h"
+
+using namespace std;
+
+// Number of threads the parallel regions will run with (1 without OpenMP)
+int thread_count();
+
+// Set the number of threads of the following parallel regions (ignored
+// without OpenMP)
+void set_thread_count(int n);
+
+// Id of the calling thread within the parallel region
+int thread_id();
+
+// Number of threads of the parallel region the caller is in (1 outside of
+// parallel regions, or in nested regions that run with a single thread)
+int team_size();
+
+// Range [begin, end) of n items that thread t of T works on. Matches the
+// distribution of "#pragma omp for schedule(static)".
+void thread_range(size_t n, int t, int T, size_t &begin, size_t &end);
+
+// Default construct the particles from index 'first' on in parallel, with
+// the same static distribution as the particle loops, so that every page is
+// first touched by (and placed on the NUMA node of) the thread using it.
+void first_touch(particle_list &p, size_t first = 0);
+
+// Pin every OpenMP thread to one core. Cores are handed out node by node,
+// so neighboring threads share a NUMA node. Does nothing for a single
+// thread, or if the user controls the affinity through OMP_PROC_BIND or
+// OMP_PLACES. Call it after the thread count is set.
+void pin_threads();
+
+// NUMA node of the core the calling thread runs on
+int current_node();
+
+// Mapping of the box grid to the threads: each thread owns a strip of box
+// columns (x-strips). The particles are kept sorted by strip, so the
+// particles of a strip are stored in memory local to its thread.
+struct numa_layout
+{
+	// Box grid the strips are cut from
+	grid G;
+
+	int num_threads;
+
+	// First box column of every strip, strip t is [first_column[t], first_column[t+1])
+	vector<int> first_column;
+
+	// Owning thread of every box column
+	vector<int> column_owner;
+
+	// First particle of every strip, as of the last sort
+	vector<size_t> first_particle;
+
+	// NUMA node every thread is running on
+	vector<int> thread_node;
+
+	// Order in which thread t looks for jobs of other threads when it ran out
+	// of its own: itself first, then the threads on its node, then the rest
+	vector<vector<int>> steal_order;
+
+	// Create the strips so that they hold about the same number of
+	// particles, and sort the particles by strip
+	void create(const grid &box_grid, particle_list &p);
+
+	// Reorder the particles by strip. Particles of a strip stay in the order
+	// they had before.
+	void sort(particle_list &p);
+
+	// Sort the particles into the boxes, every thread filling the boxes of
+	// its own strip
+	void rebin(const particle_list &p, vector<vector<int>> &box);
+
+	// Strip a position belongs to
+	int strip_of(scalar x) const;
+
+	// Second particle buffer for the sort, first touched like the original
+	particle_list buffer;
+
+	// Particles found outside of the strip of their thread during rebin
+	vector<vector<int>> strays;
+
+	// Particles of thread t in strip s during a sort, at t * num_threads + s
+	vector<size_t> strip_count;
+};
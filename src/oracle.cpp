@@ -0,0 +1,116 @@
+#include <cmath>
+#include "oracle.h"
+#include "force.h"
+#include "boundary.h"
+
+using namespace std;
+
+// Displacement between two particles, taking the nearest periodic image in
+// y direction if north and south are periodic
+static inline void displacement(const grid &G, const particle &a, const particle &b, scalar &dx, scalar &dy)
+{
+	dx = a.r.x - b.r.x;
+	dy = a.r.y - b.r.y;
+
+	if (north_wall::periodic)
+	{
+		if (dy > G.height / 2)
+			dy -= G.height;
+		else if (dy < -G.height / 2)
+			dy += G.height;
+	}
+}
+
+void reference_force(const grid &G, const particle_list &p, vector<vec> &F, vector<scalar> &scale)
+{
+	size_t n = p.size();
+	F.assign(n, vec(0, 0));
+	scale.assign(n, 0);
+
+#pragma omp parallel for schedule(dynamic, 16)
+	for (size_t i = 0; i < n; ++i)
+	{
+		const particle &a = p[i];
+
+		// Walls
+		scalar west = west_wall::force(a.r.x);
+		scalar east = east_wall::force(G.width - a.r.x);
+		scalar south = south_wall::force(a.r.y);
+		scalar north = north_wall::force(G.height - a.r.y);
+
+		vec Fi(west - east, south - north);
+		scalar si = abs(west) + abs(east) + abs(south) + abs(north);
+
+		// All other particles. Every pair is calculated twice, so the loop
+		// can run in parallel without races.
+		for (size_t j = 0; j < n; ++j)
+		{
+			if (j == i)
+				continue;
+
+			scalar dx, dy;
+			displacement(G, a, p[j], dx, dy);
+
+			scalar r = sqrt(dx * dx + dy * dy);
+			scalar f = lennard_jones(r);
+
+			if (f != 0)
+			{
+				Fi += vec(-f * dx / r, -f * dy / r);
+				si += abs(f);
+			}
+		}
+
+		F[i] = Fi;
+		scale[i] = si;
+	}
+}
+
+void reference_rdf(const grid &G, const particle_list &p, rdf_histogram &H)
+{
+	for (size_t i = 0; i < p.size(); ++i)
+		for (size_t j = i + 1; j < p.size(); ++j)
+		{
+			scalar dx, dy;
+			displacement(G, p[i], p[j], dx, dy);
+			H.add_squared(dx * dx + dy * dy);
+		}
+
+	H.samples++;
+	H.particles += p.size();
+}
+
+scalar potential_energy(const grid &G, const particle_list &p)
+{
+	size_t n = p.size();
+	scalar E = 0;
+
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : E)
+	for (size_t i = 0; i < n; ++i)
+	{
+		const particle &a = p[i];
+
+		E += west_wall::potential(a.r.x) + east_wall::potential(G.width - a.r.x) +
+			 south_wall::potential(a.r.y) + north_wall::potential(G.height - a.r.y);
+
+		for (size_t j = i + 1; j < n; ++j)
+		{
+			scalar dx, dy;
+			displacement(G, a, p[j], dx, dy);
+			E += lennard_jones_potential(sqrt(dx * dx + dy * dy));
+		}
+	}
+
+	return E;
+}
+
+scalar kinetic_energy(const particle_list &p)
+{
+	scalar E = 0;
+
+#pragma omp parallel for schedule(static) reduction(+ : E)
+	for (size_t i = 0; i < p.size(); ++i)
+		E += 0.5 * (p[i].v.x * p[i].v.x + p[i].v.y * p[i].v.y);
+
+	return E;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <vector>
+#include "common.h"
+#include "particle.h"
+#include "grid.h"
+#include "rdf.h"
+
+using namespace std;
+
+// Reference implementations for validation. They look at every pair of
+// particles (O(N^2)) and don't use boxes or jobs at all, so they can be
+// trusted to neither miss nor double count a pair.
+
+// Force on every particle, from the pairs (nearest periodic image) and the
+// walls. 'scale' receives the sum of the magnitudes of all contributions to
+// a particle, which is the natural scale for the rounding error of its force.
+void reference_force(const grid &G, const particle_list &p, vector<vec> &F, vector<scalar> &scale);
+
+// Add the distances of all pairs (nearest periodic image) to H, as one
+// sample
+void reference_rdf(const grid &G, const particle_list &p, rdf_histogram &H);
+
+// Total potential energy of pairs and walls
+scalar potential_energy(const grid &G, const particle_list &p);
+
+// Total kinetic energy (all particles have unit mass)
+scalar kinetic_energy(const particle_list &p);
@@ -0,0 +1,295 @@
+#include <iostream>
+#include <cmath>
+#include <stdexcept>
+#include "parameters.h"
+
+using namespace std;
+
+// CONSTANTS OF THE INTERACTION
+
+// Maximum distance for force calculation
+extern const scalar box_cutoff = 1.1225;
+
+// Range parameter for Lennard-Jones-Potential
+extern const scalar pot_size = 1 * pow(2, 1. / 6.);
+extern const scalar pot_size6 = 2; // pot_size^6
+
+// Convert a complete string to a number, throws invalid_argument if there
+// is anything left over
+static scalar to_scalar(const string &value)
+{
+	size_t used;
+	scalar s = stod(value, &used);
+	if (used != value.size())
+		throw invalid_argument(value);
+	return s;
+}
+
+static long to_integer(const string &value)
+{
+	size_t used;
+	long i = stol(value, &used);
+	if (used != value.size())
+		throw invalid_argument(value);
+	return i;
+}
+
+// Set a single parameter. Returns false if there is no parameter of that
+// name, throws invalid_argument if the value can't be read.
+static bool set_parameter(parameters &P, const string &name, const string &value)
+{
+	if (name == "N")
+		P.N = to_integer(value);
+	else if (name == "dt")
+		P.dt = to_scalar(value);
+	else if (name == "T_end")
+		P.T_end = to_scalar(value);
+	else if (name == "height")
+		P.height = to_scalar(value);
+	else if (name == "width")
+		P.width = to_scalar(value);
+	else if (name == "box_subdivision")
+		P.box_subdivision = to_integer(value);
+	else if (name == "grid_h")
+		P.grid_h = to_integer(value);
+	else if (name == "grid_w")
+		P.grid_w = to_integer(value);
+	else if (name == "velocity_max")
+		P.velocity_max = to_scalar(value);
+	else if (name == "seed")
+		P.seed = to_integer(value);
+	else if (name == "threads")
+		P.threads = to_integer(value);
+	else if (name == "kernel")
+	{
+		if (value == "direct")
+			P.kernel = KERNEL_DIRECT;
+		else if (value == "tiled")
+			P.kernel = KERNEL_TILED;
+		else
+			throw invalid_argument(value);
+	}
+	else if (name == "integrator")
+	{
+		if (value == "verlet")
+			P.integrator = INTEGRATOR_VERLET;
+		else if (value == "omelyan")
+			P.integrator = INTEGRATOR_OMELYAN;
+		else if (value == "forest_ruth")
+			P.integrator = INTEGRATOR_FOREST_RUTH;
+		else if (value == "respa")
+			P.integrator = INTEGRATOR_RESPA;
+		else
+			throw invalid_argument(value);
+	}
+	else if (name == "respa_substeps")
+		P.respa_substeps = to_integer(value);
+	else if (name == "energy")
+		P.report_energy = to_integer(value) != 0;
+	else if (name == "deterministic")
+		P.deterministic = to_integer(value) != 0;
+	else if (name == "numa")
+		P.use_numa_layout = to_integer(value) != 0;
+	else if (name == "pin")
+		P.pin_threads = to_integer(value) != 0;
+	else if (name == "numa_sort_interval")
+		P.numa_sort_interval = to_integer(value);
+	else if (name == "rebuild_interval")
+		P.rebuild_interval = to_integer(value);
+	else if (name == "tasks")
+		P.task_graph = to_integer(value) != 0;
+	else if (name == "block_levels")
+		P.block_levels = to_integer(value);
+	else if (name == "block_distance")
+		P.block_distance = to_scalar(value);
+	else if (name == "temporal_block")
+		P.temporal_block = to_integer(value);
+	else if (name == "tile_columns")
+		P.tile_columns = to_integer(value);
+	else if (name == "out_of_core_dir")
+		P.out_of_core_dir = value;
+	else if (name == "adaptive")
+		P.adaptive = to_integer(value) != 0;
+	else if (name == "leaf_capacity")
+		P.leaf_capacity = to_integer(value);
+	else if (name == "max_depth")
+		P.max_depth = to_integer(value);
+	else if (name == "tree_interval")
+		P.tree_interval = to_integer(value);
+	else if (name == "check_interval")
+		P.check_interval = to_integer(value);
+	else if (name == "metrics")
+		P.publish_metrics = to_integer(value) != 0;
+	else if (name == "export")
+		P.export_state = to_integer(value) != 0;
+	else if (name == "dump_file")
+		P.dump_file = value;
+	else if (name == "autotune")
+		P.autotune = to_integer(value) != 0;
+	else if (name == "tune_steps")
+		P.tune_steps = to_integer(value);
+	else if (name == "tune_file")
+		P.tune_file = value;
+	else if (name == "rdf_interval")
+		P.rdf_interval = to_integer(value);
+	else if (name == "rdf_bins")
+		P.rdf_bins = to_integer(value);
+	else if (name == "rdf_file")
+		P.rdf_file = value;
+	else if (name == "field_interval")
+		P.field_interval = to_integer(value);
+	else if (name == "field_nx")
+		P.field_nx = to_integer(value);
+	else if (name == "field_ny")
+		P.field_ny = to_integer(value);
+	else if (name == "field_file")
+		P.field_file = value;
+	else if (name == "ensemble")
+		P.ensemble = to_integer(value);
+	else
+		return false;
+
+	return true;
+}
+
+const char *invalid_parameters(const parameters &P)
+{
+	if (P.dt <= 0)
+		return "dt has to be positive";
+	if (P.box_subdivision < 1)
+		return "box_subdivision has to be at least 1";
+	if (P.grid_w < 1 || P.grid_h < 1)
+		return "grid_w and grid_h have to be at least 1";
+	if (P.N > size_t(P.grid_w) * size_t(P.grid_h))
+		return "N is larger than the grid of initial positions (grid_w * grid_h)";
+	if (P.width <= 2 * pot_size || P.height <= 0)
+		return "domain too small";
+	if (P.check_interval < 1 || P.numa_sort_interval < 1 || P.rebuild_interval < 1)
+		return "check_interval, numa_sort_interval and rebuild_interval have to be at least 1";
+	if (P.leaf_capacity < 1 || P.max_depth < 0 || P.tree_interval < 1)
+		return "leaf_capacity and tree_interval have to be at least 1, max_depth can't be negative";
+	if (P.threads < 0)
+		return "threads can't be negative";
+	if (P.tune_steps < 1)
+		return "tune_steps has to be at least 1";
+	if (P.rdf_interval < 0 || P.rdf_bins < 1)
+		return "rdf_interval can't be negative, rdf_bins has to be at least 1";
+	if (P.field_interval < 0 || P.field_nx < 1 || P.field_ny < 1)
+		return "field_interval can't be negative, field_nx and field_ny have to be at least 1";
+	if (P.block_levels < 1 || P.block_levels > 20 || P.block_distance <= 0)
+		return "block_levels has to be between 1 and 20, block_distance positive";
+	if (P.block_levels > 1 && (P.task_graph || P.rdf_interval > 0))
+		return "block time steps work neither with the task graph nor with g(r) sampling";
+	if (P.temporal_block < 1 || P.temporal_block > 64 || P.tile_columns < 1)
+		return "temporal_block has to be between 1 and 64, tile_columns positive";
+	if ((P.temporal_block > 1 || !P.out_of_core_dir.empty()) && (P.task_graph || P.block_levels > 1 || P.adaptive || P.rdf_interval > 0 ||
+								 P.field_interval > 0))
+		return "temporal blocking works neither with the task graph, block time steps, adaptive boxes nor sampling";
+	if (P.deterministic && P.task_graph)
+		return "the task graph isn't deterministic";
+	if (P.respa_substeps < 1)
+		return "respa_substeps has to be at least 1";
+	if (P.integrator != INTEGRATOR_VERLET && (P.task_graph || P.block_levels > 1 || P.temporal_block > 1 ||
+											  !P.out_of_core_dir.empty()))
+		return "the task graph, block time steps and temporal blocking only work with the verlet integrator";
+	if (P.report_energy && !P.out_of_core_dir.empty())
+		return "the energy of systems kept out of core can't be reported";
+	if (P.export_state && !P.out_of_core_dir.empty())
+		return "systems kept out of core can't be exported";
+	if (P.ensemble < 0)
+		return "ensemble can't be negative";
+
+	return nullptr;
+}
+
+bool parse_parameters(int argc, char **argv, parameters &P)
+{
+	for (int a = 1; a < argc; ++a)
+	{
+		string arg = argv[a];
+		size_t eq = arg.find('=');
+
+		if (eq == string::npos)
+		{
+			cerr << "Arguments are given as name=value, got '" << arg << "'" << endl;
+			return false;
+		}
+
+		string name = arg.substr(0, eq);
+		string value = arg.substr(eq + 1);
+
+		try
+		{
+			if (!set_parameter(P, name, value))
+			{
+				cerr << "Unknown parameter '" << name << "'. Known parameters (with their defaults):" << endl;
+				print_parameters(parameters(), cerr);
+				return false;
+			}
+		}
+		catch (logic_error &)
+		{
+			// invalid_argument or out_of_range
+			cerr << "Invalid value for " << name << ": '" << value << "'" << endl;
+			return false;
+		}
+	}
+
+	const char *error = invalid_parameters(P);
+	if (error)
+	{
+		cerr << "Invalid parameters: " << error << endl;
+		return false;
+	}
+
+	return true;
+}
+
+void print_parameters(const parameters &P, ostream &out)
+{
+	out << "  N=" << P.N << endl;
+	out << "  dt=" << P.dt << endl;
+	out << "  T_end=" << P.T_end << endl;
+	out << "  height=" << P.height << endl;
+	out << "  width=" << P.width << endl;
+	out << "  box_subdivision=" << P.box_subdivision << endl;
+	out << "  grid_h=" << P.grid_h << endl;
+	out << "  grid_w=" << P.grid_w << endl;
+	out << "  velocity_max=" << P.velocity_max << endl;
+	out << "  seed=" << P.seed << " (0: from the clock)" << endl;
+	out << "  threads=" << P.threads << " (0: OpenMP default)" << endl;
+	out << "  kernel=" << (P.kernel == KERNEL_DIRECT ? "direct" : "tiled") << " (direct, tiled)" << endl;
+	out << "  integrator=" << scheme_name(P.integrator) << " (verlet, omelyan, forest_ruth, respa)" << endl;
+	out << "  respa_substeps=" << P.respa_substeps << endl;
+	out << "  energy=" << P.report_energy << endl;
+	out << "  numa=" << P.use_numa_layout << endl;
+	out << "  numa_sort_interval=" << P.numa_sort_interval << endl;
+	out << "  pin=" << P.pin_threads << endl;
+	out << "  rebuild_interval=" << P.rebuild_interval << endl;
+	out << "  tasks=" << P.task_graph << endl;
+	out << "  deterministic=" << P.deterministic << endl;
+	out << "  block_levels=" << P.block_levels << " (1: off)" << endl;
+	out << "  block_distance=" << P.block_distance << endl;
+	out << "  temporal_block=" << P.temporal_block << " (1: off)" << endl;
+	out << "  tile_columns=" << P.tile_columns << endl;
+	out << "  out_of_core_dir=" << P.out_of_core_dir << " (empty: in memory)" << endl;
+	out << "  adaptive=" << P.adaptive << endl;
+	out << "  leaf_capacity=" << P.leaf_capacity << endl;
+	out << "  max_depth=" << P.max_depth << endl;
+	out << "  tree_interval=" << P.tree_interval << endl;
+	out << "  check_interval=" << P.check_interval << endl;
+	out << "  metrics=" << P.publish_metrics << endl;
+	out << "  export=" << P.export_state << endl;
+	out << "  dump_file=" << P.dump_file << endl;
+	out << "  autotune=" << P.autotune << endl;
+	out << "  tune_steps=" << P.tune_steps << endl;
+	out << "  tune_file=" << P.tune_file << endl;
+	out << "  rdf_interval=" << P.rdf_interval << " (0: off)" << endl;
+	out << "  rdf_bins=" << P.rdf_bins << endl;
+	out << "  rdf_file=" << P.rdf_file << endl;
+	out << "  field_interval=" << P.field_interval << " (0: off)" << endl;
+	out << "  field_nx=" << P.field_nx << endl;
+	out << "  field_ny=" << P.field_ny << endl;
+	out << "  field_file=" << P.field_file << endl;
+	out << "  ensemble=" << P.ensemble << endl;
+}
@@ -0,0 +1,203 @@
+#pragma once
+#include <string>
+#include "common.h"
+#include "grid.h"
+#include "force.h"
+#include "integrator.h"
+
+using namespace std;
+
+// SYSTEM PARAMETERS
+// Everything describing one simulated system. The defaults are the classic
+// setup, all of them can be changed on the command line (see
+// parse_parameters).
+struct parameters
+{
+	// Particle count
+	size_t N = 100;
+
+	// Step size for integration
+	scalar dt = 1e-6;
+
+	// Physical time the simulation runs for
+	scalar T_end = 10;
+
+	// Domain size
+	scalar height = 5;
+	scalar width = 5;
+
+	// Number of calculation boxes per cutoff length. Boxes are (at least)
+	// box_cutoff / box_subdivision wide, and every box interacts with all
+	// boxes within the cutoff. Finer boxes waste less distance checks on
+	// particles out of reach, but come with more overhead per box. A good
+	// choice is about one to two particles per box: 1 for dilute systems,
+	// 2-3 for dense ones.
+	int box_subdivision = 2;
+
+	// Grid of initial positions
+	int grid_h = 10;
+	int grid_w = 10;
+
+	// Maximum initial velocity
+	scalar velocity_max = 100;
+
+	// Seed for the initial velocities
+	unsigned seed = 0;
+
+	// Number of threads, 0: the OpenMP default (OMP_NUM_THREADS)
+	int threads = 0;
+
+	// Implementation of the pair force calculation (see force.h)
+	force_kernel kernel = KERNEL_TILED;
+
+	// Time integration scheme (see integrator.h), and the substeps of the
+	// wall forces per step of the multiple time step scheme. Block time
+	// steps, the task graph and temporal blocking bring their own velocity
+	// verlet.
+	integrator_scheme integrator = INTEGRATOR_VERLET;
+	int respa_substeps = 4;
+
+	// Print the total energy and its change since the start at every
+	// diagnostic output, with the wall time taken, to compare the accuracy
+	// per cost of the integrators. Not for systems kept out of core.
+	bool report_energy = false;
+
+	// NUMA aware data placement: the box columns are split into one strip
+	// per thread, and the particles are kept sorted by strip (every
+	// numa_sort_interval steps), so every thread works on memory of its own
+	// NUMA node. Jobs are preferably handed to the thread owning their
+	// boxes.
+	bool use_numa_layout = true;
+	int numa_sort_interval = 1000;
+
+	// Pin the OpenMP threads to cores, filling one NUMA node after the
+	// other (see pin_threads). Off by default, so concurrent runs aren't
+	// piled onto the same cores.
+	bool pin_threads = false;
+
+	// The box lists are rebuilt from scratch every rebuild_interval steps.
+	// In between, only the particles that changed box in the drift are
+	// moved (incremental rebinning), which leaves the lists unordered.
+	int rebuild_interval = 100;
+
+	// Run the force calculation and the kick as a graph of tasks per box
+	// and job instead of barrier separated phases. Boxes flow through the
+	// step (and into the next drift) as soon as their neighbors are done,
+	// which cuts the idle time at the barriers for small and medium
+	// systems. The NUMA locality of the job handout is not used then.
+	bool task_graph = false;
+
+	// Bitwise reproducible runs: the particles end up the same for any
+	// number of threads (with the same kernel, boxes and integrator), so
+	// long runs and their failures can be repeated exactly. The forces are
+	// summed in a fixed order anyway, since the jobs of a phase never share
+	// a box. This turns off what depends on the threads: the NUMA layout
+	// (which orders the particles by thread) and the order of the
+	// incremental rebinning. Not with the task graph, whose jobs sharing a
+	// box run in any order. Diagnostic sums (energies, fields) may still
+	// differ in the last digits.
+	bool deterministic = false;
+
+	// Block time steps for very different speeds: every particle moves in
+	// steps of dt * 2^k, k < block_levels, the longest in which it moves
+	// at most block_distance. Forces are only calculated for the particles
+	// at the end of their step, so slow particles cost much less. dt is the
+	// shortest step. 1 turns it off. Not with the task graph, the NUMA
+	// layout or g(r) sampling.
+	int block_levels = 1;
+	scalar block_distance = 1e-4;
+
+	// Temporal blocking: the domain is cut into tiles of tile_columns box
+	// columns, and every tile is copied together with a halo of the
+	// columns that can influence it and advanced temporal_block steps at
+	// once, while it sits in the cache. The halo is recomputed by both
+	// neighbors, and grows with the largest speed. 1 turns it off. Uniform
+	// grid only, not with the task graph, block time steps, the NUMA layout
+	// or the g(r) and field sampling.
+	int temporal_block = 1;
+	int tile_columns = 32;
+
+	// Out of core: keep the particles in files in this directory instead of
+	// memory, for systems larger than the memory. The files are mapped, and
+	// the sweeps of the temporal blocking (which is used with any
+	// temporal_block then) stream them through memory column by column,
+	// reading the next tile ahead. Neither box lists nor jobs are kept.
+	// Empty: in memory.
+	string out_of_core_dir = "";
+
+	// Adaptive boxes for very non-uniform densities (see quadtree.h): boxes
+	// of the cutoff size are split into quadrants while they hold more than
+	// leaf_capacity particles, up to max_depth times. The tree is rebuilt
+	// from the root boxes every tree_interval steps (merging the leaves of
+	// regions that thinned out), in between the particles are only sorted
+	// into its leaves. Replaces the NUMA layout.
+	bool adaptive = false;
+	int leaf_capacity = 16;
+	int max_depth = 4;
+	int tree_interval = 100;
+
+	// The particles are checked for NaNs and escapes through the east and
+	// west wall every check_interval steps, outside of the integration loop
+	int check_interval = 100;
+
+	// Publish step rate, energy, speed and load balance at every diagnostic
+	// output to the shared memory segment /gas_metrics.<pid>, for the
+	// monitor program (see metrics.h)
+	bool publish_metrics = false;
+
+	// Publish the particles, grouped by box, at every diagnostic output to
+	// the shared memory segment /gas_state.<pid> for analysis programs (see
+	// snapshot.h). Not for systems kept out of core.
+	bool export_state = false;
+
+	// If a check fails, the complete state is written to this file.
+	// Leave empty to disable the dump.
+	string dump_file = "gas_dump.txt";
+
+	// Find the fastest threads, box_subdivision, kernel and tasks for the
+	// system with short calibration runs of tune_steps steps each (see
+	// autotune.h). The choice is cached in tune_file for later runs of
+	// systems of the same size and shape.
+	bool autotune = false;
+	int tune_steps = 20;
+	string tune_file = "gas_tuning.txt";
+
+	// Radial distribution function g(r), sampled in the force calculation
+	// every rdf_interval steps (0: never) with rdf_bins bins up to the
+	// cutoff. The samples are written to rdf_file and cleared at every
+	// diagnostic output (see rdf.h).
+	int rdf_interval = 0;
+	int rdf_bins = 100;
+	string rdf_file = "gas_rdf.txt";
+
+	// Coarse grained density, velocity and temperature on field_nx *
+	// field_ny cells, sampled in the kick every field_interval steps (0:
+	// never). The averages are written to field_file at every diagnostic
+	// output (see fields.h).
+	int field_interval = 0;
+	int field_nx = 10;
+	int field_ny = 10;
+	string field_file = "gas_fields.txt";
+
+	// Number of independent systems to run side by side, one per thread
+	// (see ensemble.h). 0 runs a single system with all threads.
+	int ensemble = 0;
+
+	// Calculation boxes for the domain
+	grid box_grid() const
+	{
+		return grid(width, height, box_subdivision);
+	}
+};
+
+// Read parameters given as name=value pairs, e.g. "N=1000 width=20".
+// Returns false (after telling the user why) if an argument is unknown,
+// malformed or the resulting system makes no sense.
+bool parse_parameters(int argc, char **argv, parameters &P);
+
+// Reasons a set of parameters can't be simulated. Returns the first one
+// found, or nullptr if the parameters are fine.
+const char *invalid_parameters(const parameters &P);
+
+// Print the parameters in the form parse_parameters reads them
+void print_parameters(const parameters &P, ostream &out);
@@ -1,13 +1,16 @@
 #pragma once
 #include <vector>
 #include "vec.h"
+#include "allocator.h"
 #include <iostream>
 
 struct particle;
 
 using namespace std;
 
-typedef vector<particle> particle_list;
+// The list leaves default construction of its particles to first_touch()
+// (numa.h), which has to be called after creating or resizing a list.
+typedef vector<particle, first_touch_allocator<particle>> particle_list;
 
 // A particle, containing position, velocity and a force acting on it
 struct particle
@@ -0,0 +1,257 @@
+#include <iostream>
+#include <algorithm>
+#include "quadtree.h"
+#include "dispatch.h"
+
+using namespace std;
+
+quadtree::quadtree(scalar width, scalar height, int capacity, int depth)
+{
+	// Root boxes are at least as large as the cutoff, so the leaves within
+	// the cutoff of a leaf are found in the surrounding root boxes
+	G = grid(width, height, 1);
+	leaf_capacity = capacity;
+	max_depth = depth;
+
+	// With less than three rows a root box would meet another one on both
+	// sides of the periodic boundary
+	if (north_wall::periodic && G.num_boxes_y < 3)
+	{
+		cerr << "Domain too small for the periodic boundaries: " << G.num_boxes_y
+			 << " rows of root boxes, need at least 3" << endl;
+		throw 1003;
+	}
+
+	nodes.resize(G.num_boxes);
+
+	for (int y = 0; y < G.num_boxes_y; ++y)
+		for (int x = 0; x < G.num_boxes_x; ++x)
+		{
+			quad_node &n = nodes[x + y * G.num_boxes_x];
+
+			// The outermost boxes end exactly at the walls
+			n.x0 = x * G.box_size_x;
+			n.x1 = x == G.num_boxes_x - 1 ? width : (x + 1) * G.box_size_x;
+			n.y0 = y * G.box_size_y;
+			n.y1 = y == G.num_boxes_y - 1 ? height : (y + 1) * G.box_size_y;
+			n.mid_x = 0.5 * (n.x0 + n.x1);
+			n.mid_y = 0.5 * (n.y0 + n.y1);
+		}
+}
+
+void quadtree::build(const particle_list &p, vector<vector<int>> &box)
+{
+	// Start over with the bare roots
+	nodes.resize(G.num_boxes);
+	for (auto &n : nodes)
+	{
+		n.child = -1;
+		n.leaf = -1;
+	}
+
+	leaf_node.clear();
+	first_leaf.assign(G.num_boxes + 1, 0);
+	box.clear();
+
+	vector<vector<int>> root_ids(G.num_boxes);
+	for (size_t idx = 0; idx < p.size(); ++idx)
+		root_ids[coord2id(G, p[idx].r.x, p[idx].r.y)].push_back(idx);
+
+	// The leaves of every root are numbered consecutively
+	for (int r = 0; r < G.num_boxes; ++r)
+	{
+		first_leaf[r] = leaf_node.size();
+		refine(r, p, root_ids[r], 0, box);
+	}
+	first_leaf[G.num_boxes] = leaf_node.size();
+}
+
+void quadtree::refine(int node, const particle_list &p, vector<int> &ids, int depth, vector<vector<int>> &box)
+{
+	if (int(ids.size()) <= leaf_capacity || depth >= max_depth)
+	{
+		nodes[node].leaf = leaf_node.size();
+		leaf_node.push_back(node);
+		box.push_back(move(ids));
+		return;
+	}
+
+	// Copy, the node list grows below
+	quad_node parent = nodes[node];
+	int first = nodes.size();
+	nodes[node].child = first;
+
+	for (int q = 0; q < 4; ++q)
+	{
+		quad_node n;
+		n.x0 = (q & 1) ? parent.mid_x : parent.x0;
+		n.x1 = (q & 1) ? parent.x1 : parent.mid_x;
+		n.y0 = (q & 2) ? parent.mid_y : parent.y0;
+		n.y1 = (q & 2) ? parent.y1 : parent.mid_y;
+		n.mid_x = 0.5 * (n.x0 + n.x1);
+		n.mid_y = 0.5 * (n.y0 + n.y1);
+		nodes.push_back(n);
+	}
+
+	// Distribute the particles with the same test locate() uses
+	vector<vector<int>> quadrant(4);
+	for (auto idx : ids)
+		quadrant[(p[idx].r.x >= parent.mid_x) + 2 * (p[idx].r.y >= parent.mid_y)].push_back(idx);
+
+	for (int q = 0; q < 4; ++q)
+		refine(first + q, p, quadrant[q], depth + 1, box);
+}
+
+int quadtree::locate(scalar x, scalar y) const
+{
+	int n = coord2id(G, x, y);
+
+	while (nodes[n].child >= 0)
+		n = nodes[n].child + (x >= nodes[n].mid_x) + 2 * (y >= nodes[n].mid_y);
+
+	return nodes[n].leaf;
+}
+
+void quadtree::rebin(const particle_list &p, vector<vector<int>> &box) const
+{
+	for (auto &b : box)
+		b.clear();
+
+	for (size_t idx = 0; idx < p.size(); ++idx)
+		box[locate(p[idx].r.x, p[idx].r.y)].push_back(idx);
+}
+
+vector<vector<job>> quadtree::create_jobs() const
+{
+	int n = num_leaves();
+	vector<vector<pair<int, scalar>>> neighbors(n);
+
+	// Every pair of leaves within the cutoff goes to the job of the leaf
+	// with the lower id (half-shell)
+	for (int ry = 0; ry < G.num_boxes_y; ++ry)
+		for (int rx = 0; rx < G.num_boxes_x; ++rx)
+		{
+			int r = rx + ry * G.num_boxes_x;
+
+			for (int dy = -1; dy <= 1; ++dy)
+				for (int dx = -1; dx <= 1; ++dx)
+				{
+					int sx = rx + dx;
+					int sy = ry + dy;
+
+					if (sx < 0 || sx >= G.num_boxes_x)
+						continue;
+
+					// Root boxes beyond the north (south) boundary are the
+					// images of the southern (northern) ones
+					scalar shift = 0;
+					if (sy < 0 || sy >= G.num_boxes_y)
+					{
+						if (!north_wall::periodic)
+							continue;
+
+						shift = sy < 0 ? -G.height : G.height;
+						sy = (sy + G.num_boxes_y) % G.num_boxes_y;
+					}
+
+					int s = sx + sy * G.num_boxes_x;
+
+					for (int a = first_leaf[r]; a < first_leaf[r + 1]; ++a)
+						for (int b = max(first_leaf[s], a + 1); b < first_leaf[s + 1]; ++b)
+						{
+							const quad_node &A = nodes[leaf_node[a]];
+							const quad_node &B = nodes[leaf_node[b]];
+
+							// Smallest distance between two points of the leaves
+							scalar gap_x = max(max(B.x0 - A.x1, A.x0 - B.x1), scalar(0));
+							scalar gap_y = max(max(B.y0 + shift - A.y1, A.y0 - B.y1 - shift), scalar(0));
+
+							if (gap_x * gap_x + gap_y * gap_y < box_cutoff * box_cutoff)
+								neighbors[a].push_back(make_pair(b, shift));
+						}
+				}
+		}
+
+	// Crowded neighborhoods give more than one job per leaf
+	vector<job> jobs;
+	for (int a = 0; a < n; ++a)
+		split_jobs(a, neighbors[a], [&](const job &J, int) { jobs.push_back(J); });
+
+	int num_jobs = jobs.size();
+
+	// Jobs writing into every leaf
+	vector<vector<int>> writers(n);
+	for (int j = 0; j < num_jobs; ++j)
+	{
+		writers[jobs[j].origin].push_back(j);
+		for (int k = 0; k < jobs[j].count; ++k)
+			writers[jobs[j].id[k]].push_back(j);
+	}
+
+	// Greedy coloring: every job gets the lowest phase not taken by a job
+	// sharing a leaf with it. used[c] == j marks phase c as taken for job j.
+	vector<int> color(num_jobs, -1);
+	vector<int> used;
+
+	for (int j = 0; j < num_jobs; ++j)
+	{
+		auto mark = [&](int leaf) {
+			for (auto k : writers[leaf])
+				if (color[k] >= 0)
+					used[color[k]] = j;
+		};
+
+		mark(jobs[j].origin);
+		for (int k = 0; k < jobs[j].count; ++k)
+			mark(jobs[j].id[k]);
+
+		int c = 0;
+		while (c < int(used.size()) && used[c] == j)
+			++c;
+
+		if (c == int(used.size()))
+			used.push_back(-1);
+
+		color[j] = c;
+	}
+
+	vector<vector<job>> phases(used.size());
+	for (int j = 0; j < num_jobs; ++j)
+		phases[color[j]].push_back(jobs[j]);
+
+	return phases;
+}
+
+Boundaries quadtree::boundaries() const
+{
+	Boundaries B(G);
+
+	B.force_boxes.clear();
+	B.west_boxes.clear();
+	B.east_boxes.clear();
+	B.south_boxes.clear();
+	B.north_boxes.clear();
+
+	for (int l = 0; l < num_leaves(); ++l)
+	{
+		const quad_node &n = nodes[leaf_node[l]];
+
+		if ((west_wall::has_force && n.x0 < box_cutoff) ||
+			(east_wall::has_force && n.x1 > G.width - box_cutoff) ||
+			(south_wall::has_force && n.y0 < box_cutoff) ||
+			(north_wall::has_force && n.y1 > G.height - box_cutoff))
+			B.force_boxes.push_back(l);
+
+		// The outermost leaves end exactly at the walls, see the constructor
+		if (n.x0 == 0)
+			B.west_boxes.push_back(l);
+		if (n.x1 == G.width)
+			B.east_boxes.push_back(l);
+		if (n.y0 == 0)
+			B.south_boxes.push_back(l);
+		if (n.y1 == G.height)
+			B.north_boxes.push_back(l);
+	}
+
+	return B;
+}
@@ -0,0 +1,87 @@
+#pragma once
+#include <vector>
+#include "common.h"
+#include "grid.h"
+#include "particle.h"
+#include "job.h"
+#include "boundary.h"
+
+using namespace std;
+
+// Adaptive boxes for very non-uniform densities. The domain is covered by
+// root boxes of at least the cutoff size, and every root box is split into
+// quadrants as long as it holds more than leaf_capacity particles (up to
+// max_depth times). Sparse regions are covered by few large boxes, crowded
+// ones by many small ones, which keeps the cost of every job bounded.
+//
+// The leaves take the place of the boxes of the uniform grid: the particles
+// are sorted into one list per leaf, and the jobs (origin leaf and the
+// leaves within the cutoff) are handed to the Dispatcher, so the force
+// kernels work on them unchanged. Since the leaves don't form a regular
+// grid, the phases are found by coloring the jobs.
+struct quad_node
+{
+	// Area covered by the node
+	scalar x0, y0;
+	scalar x1, y1;
+
+	// Splitting point, the children are the quadrants around it
+	scalar mid_x, mid_y;
+
+	// First of the four children (south west, south east, north west,
+	// north east), -1 for leaves
+	int child = -1;
+
+	// Leaf id, -1 for inner nodes
+	int leaf = -1;
+};
+
+struct quadtree
+{
+	// Grid of the root boxes (one box per cutoff length)
+	grid G;
+
+	// Largest number of particles a leaf should hold, and the number of
+	// times a root box can be split at most
+	int leaf_capacity = 16;
+	int max_depth = 4;
+
+	// All nodes, the first G.num_boxes of them are the roots
+	vector<quad_node> nodes;
+
+	// Node of every leaf. The leaves of root r are
+	// [first_leaf[r], first_leaf[r + 1]).
+	vector<int> leaf_node;
+	vector<int> first_leaf;
+
+	quadtree() {}
+	quadtree(scalar width, scalar height, int capacity, int depth);
+
+	// Create the tree for the particles, starting over from the bare roots,
+	// and sort them into the leaves. Quadrants that together hold no more
+	// than leaf_capacity particles stay one leaf, so regions that thinned
+	// out since the last build get large leaves again.
+	void build(const particle_list &p, vector<vector<int>> &box);
+
+	// Sort the particles into the existing leaves
+	void rebin(const particle_list &p, vector<vector<int>> &box) const;
+
+	// Leaf of a position
+	int locate(scalar x, scalar y) const;
+
+	// Number of leaves
+	int num_leaves() const
+	{
+		return leaf_node.size();
+	}
+
+	// Jobs of all leaves, sorted into phases in which no two jobs touch the
+	// same leaf
+	vector<vector<job>> create_jobs() const;
+
+	// Leaves along the walls, for the boundary conditions
+	Boundaries boundaries() const;
+
+	// Split a node (recursively) until its particles fit
+	void refine(int node, const particle_list &p, vector<int> &ids, int depth, vector<vector<int>> &box);
+};
@@ -0,0 +1,52 @@
+#include <cmath>
+#include "rdf.h"
+
+using namespace std;
+
+rdf_histogram::rdf_histogram(int num_bins)
+{
+	bins = num_bins;
+	bin_width = box_cutoff / bins;
+	counts.assign(bins, 0);
+}
+
+void rdf_histogram::merge(const rdf_histogram &H)
+{
+	for (int b = 0; b < bins; ++b)
+		counts[b] += H.counts[b];
+
+	samples += H.samples;
+	particles += H.particles;
+}
+
+void rdf_histogram::clear()
+{
+	counts.assign(bins, 0);
+	samples = 0;
+	particles = 0;
+}
+
+void write_rdf(const rdf_histogram &H, const grid &G, scalar time, ostream &out)
+{
+	out << "# time " << time << ", " << H.samples << " samples" << endl;
+
+	// Average particle count and density of the samples
+	scalar N = H.samples ? scalar(H.particles) / H.samples : 0;
+	scalar density = N / (G.width * G.height);
+
+	for (int b = 0; b < H.bins; ++b)
+	{
+		scalar r0 = b * H.bin_width;
+		scalar r1 = r0 + H.bin_width;
+
+		// Pairs an ideal gas has in this shell: every particle sees
+		// density * area of the shell others, every pair is counted once
+		scalar ideal = 0.5 * N * density * M_PI * (r1 * r1 - r0 * r0) * H.samples;
+		scalar g = ideal > 0 ? H.counts[b] / ideal : 0;
+
+		out << 0.5 * (r0 + r1) << " " << g << " " << H.counts[b] << endl;
+	}
+
+	// Two empty lines separate the data sets for gnuplot's 'index'
+	out << endl << endl;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <ostream>
+#include "common.h"
+#include "grid.h"
+
+using namespace std;
+
+// RADIAL DISTRIBUTION FUNCTION
+// Histogram of the pair distances, filled in situ by the pair loops of
+// update_force on sampling steps. The loops only see the pairs within
+// box_cutoff, so g(r) is known up to that distance. Pairs reached through
+// the periodic boundary are counted with the distance of their image.
+struct rdf_histogram
+{
+	// Number of bins between 0 and box_cutoff
+	int bins = 0;
+	scalar bin_width = 0;
+
+	// Number of pairs per bin, summed over all samples
+	vector<size_t> counts;
+
+	// Number of configurations sampled, and the number of particles in
+	// them (summed)
+	size_t samples = 0;
+	size_t particles = 0;
+
+	rdf_histogram() {}
+	rdf_histogram(int bins);
+
+	// Count a pair at distance r. Pairs beyond box_cutoff are ignored.
+	void add(scalar r)
+	{
+		int bin = int(r / bin_width);
+		if (bin < bins)
+			counts[bin]++;
+	}
+
+	// Same for the squared distance
+	void add_squared(scalar r2)
+	{
+		if (r2 < box_cutoff * box_cutoff)
+			add(sqrt(r2));
+	}
+
+	// Add the counts and samples of another histogram of the same size
+	void merge(const rdf_histogram &H);
+
+	// Forget all samples
+	void clear();
+};
+
+// Write g(r) of the samples in H, one line "r g(r) pairs" per bin, after a
+// comment line with the time. The counts are normalized by the pairs an
+// ideal gas of the same density would have, ignoring the walls.
+void write_rdf(const rdf_histogram &H, const grid &G, scalar time, ostream &out);
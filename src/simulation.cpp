@@ -0,0 +1,1180 @@
+#include <iostream>
+#include <cmath>
+#include <ctime>
+#include <algorithm>
+#include <chrono>
+#include "simulation.h"
+#include "force.h"
+#include "dispatch.h"
+#include "check.h"
+#include "integrator.h"
+
+using namespace std;
+
+Simulation::Simulation(const parameters &system)
+	: P(system), G(system.box_grid()), box(system.out_of_core_dir.empty() ? G.num_boxes : 0),
+	  D(G, system.out_of_core_dir.empty()), walls(G)
+{
+	// The load balance is only measured for the live metrics
+	D.timing = P.publish_metrics;
+
+	// The time step levels would have to follow the particles through
+	// the sort, and the sweeps of the temporal blocking write the
+	// particles of a tile from a single thread. The strips depend on the
+	// number of threads, deterministic runs can't have them.
+	if (P.block_levels > 1 || P.temporal_block > 1 || out_of_core() || P.deterministic)
+		P.use_numa_layout = false;
+
+	// The adaptive boxes don't form strips of columns
+	if (P.adaptive)
+	{
+		P.use_numa_layout = false;
+		Q = quadtree(P.width, P.height, P.leaf_capacity, P.max_depth);
+	}
+
+	if (P.rdf_interval > 0)
+		rdf = rdf_histogram(P.rdf_bins);
+
+	if (P.field_interval > 0)
+		fields = coarse_fields(P.width, P.height, P.field_nx, P.field_ny);
+
+	// Seed the RNG
+	if (P.seed == 0)
+		P.seed = ::time(NULL);
+	rng.seed(P.seed);
+
+	// Create a list of particles
+	// particle_list is a vector of particles, its memory is first touched
+	// in parallel
+	if (out_of_core())
+	{
+		p = particle_list(first_touch_allocator<particle>(P.out_of_core_dir.c_str()));
+		next = particle_list(p.get_allocator());
+	}
+
+	p.resize(P.N);
+	first_touch(p);
+
+	init_particles();
+
+	// Out of core, the particles are sorted by column instead of into
+	// boxes, and the first forces come from a sweep
+	if (out_of_core())
+	{
+		next.resize(p.size());
+		first_touch(next);
+		p.swap(next);
+		sort_columns();
+		sweep(0);
+		return;
+	}
+
+	// Sort the particles into strips, so the particles of every strip lie in
+	// memory first touched by the strip's thread
+	if (P.use_numa_layout)
+	{
+		L.create(G, p);
+		D.assign_owners(L);
+	}
+
+	rebin();
+
+	// Update the force once, so that the first verlet step
+	// has something to work with
+	update_force(p, box, D, walls, P.kernel, nullptr, &tiles);
+
+	// All particles start their first block step
+	if (P.block_levels > 1)
+	{
+		// Once more on the finest level, for the closing speeds
+		level.assign(p.size(), 0);
+		closing.assign(p.size(), 0);
+		block_force();
+
+#pragma omp parallel for schedule(static)
+		for (size_t part = 0; part < p.size(); ++part)
+		{
+			level[part] = choose_level(part, 0);
+			p[part].v += 0.5 * (P.dt * (1 << level[part])) * p[part].F;
+		}
+	}
+}
+
+void Simulation::init_particles()
+{
+	uniform_real_distribution<scalar> uniform(0, 1);
+
+	for (size_t i = 0; i < p.size(); ++i)
+	{
+		// Velocity randomized, random speed and direction
+		scalar r_v = P.velocity_max * uniform(rng);
+		scalar r_phi = 2 * M_PI * uniform(rng);
+
+		// Set the random velocity
+		p[i].v = vec(sin(r_phi) * r_v, cos(r_phi) * r_v);
+
+		// Determine position on the grid
+		int pos_x = i % P.grid_w;
+		int pos_y = i / P.grid_w;
+
+		// Convert grid postion to physical position
+		// We stay away from the repulsive walls (east and west, and north
+		// and south unless they are periodic) to not introduce more energy
+		// to the system
+		scalar x = scalar(pos_x) / scalar(P.grid_w) * (P.width - 2 * pot_size) + pot_size;
+		scalar y = north_wall::periodic ? scalar(pos_y) / scalar(P.grid_h + 1) * P.height
+										: scalar(pos_y) / scalar(P.grid_h) * (P.height - 2 * pot_size) + pot_size;
+		// Set position
+		p[i].r = vec(x, y);
+	}
+}
+
+void Simulation::rebin()
+{
+	if (P.adaptive)
+	{
+		if (steps % P.tree_interval == 0)
+			rebuild_tree();
+		else
+			Q.rebin(p, box);
+	}
+	else if (P.use_numa_layout)
+	{
+		L.rebin(p, box);
+	}
+	else
+	{
+		// Remove old ids
+		for (int i = 0; i < G.num_boxes; ++i)
+			box[i].clear();
+
+		for (size_t part = 0; part < p.size(); ++part)
+			box[coord2id(G, p[part].r.x, p[part].r.y)].push_back(part);
+	}
+
+	// Remember the box of every particle for the incremental rebinning
+	if (!P.adaptive)
+	{
+		cell.resize(p.size());
+
+#pragma omp parallel for schedule(static)
+		for (int b = 0; b < G.num_boxes; ++b)
+			for (auto idx : box[b])
+				cell[idx] = b;
+	}
+}
+
+void Simulation::move_particles()
+{
+	// The wall policies moved some of the particles in the outer boxes
+	// after the drift, these are checked as well
+	vector<int> &outer = movers[0];
+	for (auto list : {&walls.west_boxes, &walls.east_boxes, &walls.south_boxes, &walls.north_boxes})
+		for (auto b : *list)
+			outer.insert(outer.end(), box[b].begin(), box[b].end());
+
+	// The order of the moves decides the order of the box lists, and with
+	// it the order in which the forces are summed. Deterministic runs move
+	// the particles by index, independent of the threads of the drift.
+	if (P.deterministic)
+	{
+		for (size_t t = 1; t < movers.size(); ++t)
+		{
+			outer.insert(outer.end(), movers[t].begin(), movers[t].end());
+			movers[t].clear();
+		}
+
+		sort(outer.begin(), outer.end());
+		outer.erase(unique(outer.begin(), outer.end()), outer.end());
+	}
+
+	// Particles can be listed more than once, moving them is idempotent
+	for (auto &list : movers)
+		for (auto idx : list)
+		{
+			int to = coord2id(G, p[idx].r.x, p[idx].r.y);
+			int from = cell[idx];
+
+			if (to == from)
+				continue;
+
+			vector<int> &old_box = box[from];
+			auto it = find(old_box.begin(), old_box.end(), idx);
+			*it = old_box.back();
+			old_box.pop_back();
+
+			box[to].push_back(idx);
+			cell[idx] = to;
+		}
+}
+
+void Simulation::drift_particle(size_t part, bool incremental, vector<int> &moved, scalar tau)
+{
+	particle &i = p[part];
+
+	// With block time steps and the splitting schemes, the kicks are done
+	// on their own (kick-drift-kick), v is the velocity of the drift already
+	if (P.block_levels > 1 || P.integrator == INTEGRATOR_OMELYAN || P.integrator == INTEGRATOR_FOREST_RUTH)
+		i.r += tau * i.v;
+	else if (P.integrator == INTEGRATOR_RESPA)
+		respa_drift(i, tau);
+	else
+		i.r += tau * i.v + 0.5 * tau * tau * i.F;
+
+	if (incremental && coord2id(G, i.r.x, i.r.y) != cell[part])
+		moved.push_back(part);
+}
+
+void Simulation::respa_drift(particle &i, scalar tau) const
+{
+	int n = P.respa_substeps;
+	scalar h = tau / n;
+
+	// F holds the pair and the wall forces at the current position: half a
+	// kick of the pair forces, and the first half kick of the substeps
+	vec W = wall_force_at(i.r, G);
+	i.v.x += 0.5 * tau * (i.F.x - W.x) + 0.5 * h * W.x;
+	i.v.y += 0.5 * tau * (i.F.y - W.y) + 0.5 * h * W.y;
+
+	for (int s = 1; s <= n; ++s)
+	{
+		i.r += h * i.v;
+
+		// The last half kick is the first one of the next step
+		W = wall_force_at(i.r, G);
+		i.v += (s < n ? h : 0.5 * h) * W;
+	}
+}
+
+void Simulation::rebuild_tree()
+{
+	Q.build(p, box);
+	D.set_jobs(Q.create_jobs());
+	walls = Q.boundaries();
+
+	// The neighbors of the block time steps come from the jobs
+	shell.clear();
+}
+
+void Simulation::drift(bool incremental, scalar tau)
+{
+	// Particles that leave their box are noted for the incremental
+	// rebinning
+	movers.resize(thread_count());
+#pragma omp parallel
+	{
+		vector<int> &moved = movers[thread_id()];
+		moved.clear();
+
+#pragma omp for schedule(static)
+		for (size_t part = 0; part < p.size(); ++part)
+			drift_particle(part, incremental, moved, tau);
+	}
+}
+
+void Simulation::kick(scalar tau, bool coarse)
+{
+#pragma omp parallel
+	{
+		coarse_fields local;
+		if (coarse)
+			local = coarse_fields(P.width, P.height, P.field_nx, P.field_ny);
+
+#pragma omp for schedule(static)
+		for (size_t part = 0; part < p.size(); ++part)
+		{
+			particle &i = p[part];
+			i.v += tau * i.F;
+
+			if (coarse)
+				local.add(i);
+		}
+
+		if (coarse)
+		{
+#pragma omp critical(field_merge)
+			fields.merge(local);
+		}
+	}
+
+	if (coarse)
+		fields.samples++;
+}
+
+void Simulation::update_boxes(bool incremental, bool checks)
+{
+	// Apply the boundary conditions to the particles in the boxes along the
+	// walls (the boxes are still the ones from before the drift). This can
+	// not handle particles that move more than a box in one drift (although
+	// that would probably break the simulation anyways), the invariant
+	// check will report them.
+	bool removed = cross_walls(p, box, walls, &removed_ids) > 0;
+	if (removed && P.block_levels > 1)
+	{
+		// The levels follow the particles that filled the gaps
+		for (auto it = removed_ids.rbegin(); it != removed_ids.rend(); ++it)
+		{
+			level[*it] = level.back();
+			level.pop_back();
+			closing[*it] = closing.back();
+			closing.pop_back();
+		}
+	}
+	if (removed && P.use_numa_layout)
+	{
+		// Absorbed particles were removed, recreate the strips
+		L.sort(p);
+	}
+
+	// Check for NaNs and escaped particles
+	if (checks && steps % P.check_interval == 0)
+	{
+		int error = check_particles(G, p, failed);
+		if (error)
+			throw error;
+	}
+
+	// Particles that changed strip are brought back to their thread every
+	// numa_sort_interval steps
+	bool sorted = checks && P.use_numa_layout && steps % P.numa_sort_interval == 0;
+	if (sorted)
+		L.sort(p);
+
+	// Update the boxes. Removing or sorting particles changes the indices,
+	// the lists have to be rebuilt then.
+	if (incremental && !removed && !sorted)
+		move_particles();
+	else
+		rebin();
+}
+
+void Simulation::step_splitting(bool incremental, bool sample, bool coarse)
+{
+	scalar dt = P.dt;
+	splitting S = scheme_splitting(P.integrator);
+
+	for (int k = 0; k < S.stages; ++k)
+	{
+		kick(S.kick[k] * dt, false);
+		drift(incremental, S.drift[k] * dt);
+
+		// The checks and the NUMA sort once per step
+		update_boxes(incremental, k == 0);
+
+		// g(r) is sampled at the end of the step
+		bool last = k + 1 == S.stages;
+		update_force(p, box, D, walls, P.kernel, sample && last ? &rdf : nullptr, &tiles);
+	}
+
+	kick(S.kick[S.stages] * dt, coarse);
+}
+
+void Simulation::step(size_t n)
+{
+	scalar dt = P.dt;
+
+	// The task graph does the drift of the next step together with the kick
+	bool drifted = false;
+
+	// Temporal blocking does all parts of temporal_block steps in one go
+	if (P.temporal_block > 1 || out_of_core())
+	{
+		for (size_t s = 0; s < n; s += P.temporal_block)
+			sweep(min(n - s, size_t(P.temporal_block)));
+		return;
+	}
+
+	for (size_t s = 0; s < n; ++s)
+	{
+		// Boxes are kept up to date incrementally on the uniform grid
+		bool incremental = !P.adaptive && steps % P.rebuild_interval != 0;
+
+		// The pair distances are sampled in the force calculation every
+		// rdf_interval steps, the coarse fields in the kick every
+		// field_interval steps
+		bool sample = P.rdf_interval > 0 && (steps + 1) % P.rdf_interval == 0;
+		bool coarse = P.field_interval > 0 && (steps + 1) % P.field_interval == 0;
+
+		// The higher order schemes drift and kick several times per step
+		if (P.integrator == INTEGRATOR_OMELYAN || P.integrator == INTEGRATOR_FOREST_RUTH)
+		{
+			step_splitting(incremental, sample, coarse);
+
+			T += dt;
+			++steps;
+			continue;
+		}
+
+		// Step 1: Update all particle positions (drift), and the boxes
+		if (!drifted)
+			drift(incremental, dt);
+
+		update_boxes(incremental, true);
+
+		if (P.block_levels > 1)
+		{
+			// Steps 2 and 3 for the particles at the end of their block
+			// step only
+			block_force();
+			block_kick(coarse);
+		}
+		else if (P.task_graph)
+		{
+			// Steps 2, 3 and the drift of the next step without barriers
+			drifted = s + 1 < n;
+			step_tasks(sample, coarse, drifted);
+		}
+		else
+		{
+			// Step 2: Update particle forces
+			update_force(p, box, D, walls, P.kernel, sample ? &rdf : nullptr, &tiles);
+
+			// Step 3: Update the particles' velocities (kick)
+			// pF denotes the force from the last step, prior
+			// to the force update. Every field_interval steps the
+			// particles are binned into the coarse fields on the way,
+			// every thread into its own copy. The multiple time step
+			// scheme did the first half kick and the wall forces in the
+			// drift already.
+			bool respa = P.integrator == INTEGRATOR_RESPA;
+#pragma omp parallel
+			{
+				coarse_fields local;
+				if (coarse)
+					local = coarse_fields(P.width, P.height, P.field_nx, P.field_ny);
+
+#pragma omp for schedule(static)
+				for (size_t part = 0; part < p.size(); ++part)
+				{
+					particle &i = p[part];
+					if (respa)
+					{
+						vec W = wall_force_at(i.r, G);
+						i.v.x += 0.5 * dt * (i.F.x - W.x);
+						i.v.y += 0.5 * dt * (i.F.y - W.y);
+					}
+					else
+						i.v += 0.5 * dt * (i.F + i.pF);
+
+					if (coarse)
+						local.add(i);
+				}
+
+				if (coarse)
+				{
+#pragma omp critical(field_merge)
+					fields.merge(local);
+				}
+			}
+
+			if (coarse)
+				fields.samples++;
+		}
+
+		// Update the timers
+		T += dt;
+		++steps;
+	}
+}
+
+void Simulation::step_tasks(bool sample, bool coarse, bool drift_next)
+{
+	scalar dt = P.dt;
+	int num_boxes = box.size();
+	int threads = thread_count();
+
+	// The drift of the next step, see step()
+	bool incremental = !P.adaptive && (steps + 1) % P.rebuild_interval != 0;
+	if (drift_next)
+	{
+		movers.resize(threads);
+		for (auto &moved : movers)
+			moved.clear();
+	}
+
+	// Per thread tiles, histograms and fields. Tasks are tied to their
+	// thread, so thread_id() picks a private copy.
+	tiles.resize(threads);
+
+	vector<rdf_histogram> histograms;
+	if (sample)
+		histograms.assign(threads, rdf_histogram(P.rdf_bins));
+
+	vector<coarse_fields> local_fields;
+	if (coarse)
+		local_fields.assign(threads, coarse_fields(P.width, P.height, P.field_nx, P.field_ny));
+
+	wall_box.assign(num_boxes, 0);
+	for (auto b : walls.force_boxes)
+		wall_box[b] = 1;
+
+	// Dependencies are tracked by box: the tasks of a box write into its
+	// token. Pair jobs sharing a box exclude each other, but don't need to
+	// run in any order (mutexinoutset), so no phases are needed.
+	box_token.resize(num_boxes);
+
+	D.busy.resize(threads);
+
+#pragma omp parallel
+	{
+		// Skip the jobs of empty regions
+		D.compact(box);
+
+#pragma omp single
+		{
+			// Backup and clear the forces, then add the wall forces
+			for (int b = 0; b < num_boxes; ++b)
+			{
+#pragma omp task depend(out : box_token.data()[b]) firstprivate(b)
+				{
+					for (auto idx : box[b])
+					{
+						particle &i = p[idx];
+						i.pF = i.F;
+						i.F = vec(0, 0);
+					}
+
+					if (wall_box[b])
+						wall_force(p, box[b], walls.G);
+				}
+			}
+
+			// Pair forces, a task per job that has any pairs
+			for (int ph = 0; ph < D.num_phases; ++ph)
+				for (auto j : D.active[ph])
+				{
+					const job *JP = &D.jobs[ph][j];
+
+#pragma omp task depend(mutexinoutset : box_token.data()[JP->origin]) \
+	depend(iterator(k = 0 : JP->count), mutexinoutset : box_token.data()[JP->id[k]]) firstprivate(JP)
+					{
+						int t = thread_id();
+						rdf_histogram *h = sample ? &histograms[t] : nullptr;
+
+						chrono::steady_clock::time_point start;
+						if (D.timing)
+							start = chrono::steady_clock::now();
+
+						if (P.kernel == KERNEL_TILED)
+							job_force_tiled(p, box, *JP, tiles[t], h);
+						else
+							job_force_direct(p, box, *JP, h);
+
+						if (D.timing)
+						{
+							chrono::duration<double> busy = chrono::steady_clock::now() - start;
+							D.busy[t].seconds += busy.count();
+						}
+					}
+				}
+
+			// Kick, as soon as all jobs of a box are done, and drift of the next
+			// step, which only needs the particle's own force
+			for (int b = 0; b < num_boxes; ++b)
+			{
+#pragma omp task depend(in : box_token.data()[b]) firstprivate(b)
+				{
+					int t = thread_id();
+
+					for (auto idx : box[b])
+					{
+						particle &i = p[idx];
+						i.v += 0.5 * dt * (i.F + i.pF);
+
+						if (coarse)
+							local_fields[t].add(i);
+
+						if (drift_next)
+							drift_particle(idx, incremental, movers[t], dt);
+					}
+				}
+			}
+		}
+	}
+
+	for (auto &H : histograms)
+		rdf.merge(H);
+	if (sample)
+	{
+		rdf.samples++;
+		rdf.particles += p.size();
+	}
+
+	for (auto &F : local_fields)
+		fields.merge(F);
+	if (coarse)
+		fields.samples++;
+}
+
+void Simulation::sweep(size_t n)
+{
+	size_t touched = next.size();
+	next.resize(p.size());
+	first_touch(next, touched);
+
+	int tiles = (G.num_boxes_x + P.tile_columns - 1) / P.tile_columns;
+	int threads = thread_count();
+
+	// Columns the particles can cross at up to twice their largest speed
+	if (sweep_speed < 0)
+		sweep_speed = max_speed();
+	sweep_travel = int(2 * sweep_speed * n * P.dt / G.box_size_x) + 1;
+
+	// Every thread reads the particles of its tiles and their halos from p
+	// and writes only the particles of its tiles to next. A particle that
+	// crossed more columns (it got faster within the sweep) may have been
+	// missed by the halo of another tile, the sweep is done again with
+	// twice the halo then. p is still untouched at that point. A halo
+	// covering all columns can't be outrun.
+	sweeps.resize(threads);
+	int escaped;
+	while (true)
+	{
+#pragma omp parallel
+		{
+			sweep_tile &S = sweeps[thread_id()];
+			S.removed.clear();
+			S.escaped = -1;
+			S.speed2 = 0;
+
+#pragma omp for schedule(dynamic, 1)
+			for (int t = 0; t < tiles; ++t)
+			{
+				int first = t * P.tile_columns;
+				int last = min(first + P.tile_columns, G.num_boxes_x);
+
+				// The tile this thread probably gets next is read from the
+				// file while this one is advanced
+				if (out_of_core() && t + threads < tiles)
+				{
+					int ahead = min(last + (threads - 1) * P.tile_columns, G.num_boxes_x);
+					int until = min(ahead + P.tile_columns, G.num_boxes_x);
+					prefetch(&p[0] + column_start[ahead],
+							 (column_start[until] - column_start[ahead]) * sizeof(particle));
+				}
+
+				advance_tile(S, first, last, n);
+			}
+		}
+
+		escaped = -1;
+		for (auto &S : sweeps)
+			if (S.escaped >= 0)
+				escaped = S.escaped;
+
+		if (escaped < 0 || sweep_travel >= G.num_boxes_x)
+			break;
+
+		sweep_travel *= 2;
+	}
+
+	// Check for NaNs and escaped particles if one of the steps was due
+	bool checked = false;
+	for (size_t s = steps; s < steps + n; ++s)
+		checked = checked || s % P.check_interval == 0;
+
+	T += n * P.dt;
+	steps += n;
+
+	if (escaped >= 0)
+	{
+		p.swap(next);
+		failed = escaped;
+		throw ERROR_HALO;
+	}
+
+	scalar speed2 = 0;
+	for (auto &S : sweeps)
+		speed2 = max(speed2, S.speed2);
+	sweep_speed = sqrt(speed2);
+
+	removed_ids.clear();
+	for (auto &S : sweeps)
+		removed_ids.insert(removed_ids.end(), S.removed.begin(), S.removed.end());
+	sort(removed_ids.begin(), removed_ids.end());
+
+	if (out_of_core())
+	{
+		// Bring the particles back into column order, on the way to p
+		sort_columns();
+	}
+	else
+	{
+		// Removed particles leave gaps, filled from the end as in
+		// cross_walls
+		p.swap(next);
+		for (auto it = removed_ids.rbegin(); it != removed_ids.rend(); ++it)
+		{
+			p[*it] = p.back();
+			p.pop_back();
+		}
+	}
+
+	if (checked)
+	{
+		int error = check_particles(G, p, failed);
+		if (error)
+			throw error;
+	}
+
+	if (!out_of_core())
+		rebin();
+}
+
+void Simulation::sort_columns()
+{
+	int nx = G.num_boxes_x;
+	size_t n = next.size();
+
+	// Every thread counts the particles per column in its part of the list,
+	// and copies them to its own range of every column
+	vector<vector<size_t>> offset(thread_count(), vector<size_t>(nx, 0));
+	column_start.assign(nx + 1, 0);
+
+	auto column = [&](size_t idx) { return coord2id(G, next[idx].r.x, next[idx].r.y) % nx; };
+	auto removed = [&](size_t idx) {
+		return !removed_ids.empty() && binary_search(removed_ids.begin(), removed_ids.end(), int(idx));
+	};
+
+#pragma omp parallel
+	{
+		vector<size_t> &mine = offset[thread_id()];
+
+#pragma omp for schedule(static)
+		for (size_t idx = 0; idx < n; ++idx)
+			if (!removed(idx))
+				mine[column(idx)]++;
+
+#pragma omp single
+		{
+			size_t total = 0;
+			for (int x = 0; x < nx; ++x)
+			{
+				column_start[x] = total;
+				for (auto &counts : offset)
+				{
+					size_t count = counts[x];
+					counts[x] = total;
+					total += count;
+				}
+			}
+			column_start[nx] = total;
+
+			// Removing particles only shrinks the list
+			p.resize(total);
+		}
+
+		// Same partition of the list as in the counting
+#pragma omp for schedule(static)
+		for (size_t idx = 0; idx < n; ++idx)
+			if (!removed(idx))
+				p[mine[column(idx)]++] = next[idx];
+	}
+}
+
+
+void Simulation::advance_tile(sweep_tile &S, int first, int last, size_t n)
+{
+	int nx = G.num_boxes_x;
+	int ny = G.num_boxes_y;
+	scalar dt = P.dt;
+
+	// Without steps, only the forces of the current positions are
+	// calculated
+	bool initial = n == 0;
+	size_t rounds = max(n, size_t(1));
+
+	// Columns that can influence the tile within n steps: the forces reach
+	// that far in every step, plus the columns particles can move in from
+	int halo = int(rounds) * D.reach_x + sweep_travel;
+	int lo = max(first - halo, 0);
+	int hi = min(last + halo, nx);
+	int width = hi - lo;
+	int boxes = width * ny;
+
+	S.p.clear();
+	S.origin.clear();
+	S.owned.clear();
+	S.column.clear();
+
+	if (out_of_core())
+	{
+		// The columns are consecutive in the file
+		for (int x = lo; x < hi; ++x)
+			for (size_t idx = column_start[x]; idx < column_start[x + 1]; ++idx)
+			{
+				S.p.push_back(p[idx]);
+				S.origin.push_back(idx);
+				S.owned.push_back(x >= first && x < last);
+				S.column.push_back(x);
+			}
+	}
+	else
+	{
+		for (int x = lo; x < hi; ++x)
+			for (int y = 0; y < ny; ++y)
+				for (auto idx : box[x + y * nx])
+				{
+					S.p.push_back(p[idx]);
+					S.origin.push_back(idx);
+					S.owned.push_back(x >= first && x < last);
+					S.column.push_back(x);
+				}
+	}
+
+	S.gone.assign(S.p.size(), 0);
+	S.cell.resize(S.p.size());
+	S.order.resize(S.p.size());
+
+	// Local box of a box of the grid, -1 outside the columns of the copies
+	auto local_box = [&](int id) {
+		int x = id % nx;
+		return x < lo || x >= hi ? -1 : (x - lo) + (id / nx) * width;
+	};
+
+	// Half shell of a local box: the local box of every offset of the
+	// stencil (-1 outside), with the shift of its periodic image
+	auto neighbor = [&](int b, const id_vec &offset, scalar &shift) {
+		int x = b % width + offset.x;
+		int y = b / width + offset.y;
+		shift = 0;
+
+		if (x < 0 || x >= width)
+			return -1;
+
+		if (y >= ny)
+		{
+			if (!north_wall::periodic)
+				return -1;
+
+			y -= ny;
+			shift = G.height;
+		}
+
+		return x + y * width;
+	};
+
+	// Pair force, on both particles at once since the thread owns all
+	// copies
+	auto pair_force = [](particle &i, particle &j, scalar shift) {
+		scalar deltax = i.r.x - j.r.x;
+		scalar deltay = i.r.y - (j.r.y + shift);
+		scalar r = sqrt(deltax * deltax + deltay * deltay);
+		scalar f = lennard_jones(r);
+
+		if (f != 0)
+		{
+			scalar Fx = -f * deltax / r;
+			scalar Fy = -f * deltay / r;
+			i.F.x += Fx;
+			i.F.y += Fy;
+			j.F.x -= Fx;
+			j.F.y -= Fy;
+		}
+	};
+
+	for (size_t s = 0; s < rounds; ++s)
+	{
+		// Drift and walls. Copies of the halo may leave the columns, they
+		// don't get a force any more then.
+		S.start.assign(boxes + 1, 0);
+
+		for (size_t part = 0; part < S.p.size(); ++part)
+		{
+			S.cell[part] = -1;
+			if (S.gone[part])
+				continue;
+
+			particle &i = S.p[part];
+			if (!initial)
+				i.r += dt * i.v + 0.5 * dt * dt * i.F;
+
+			if (!cross_walls(i, G))
+			{
+				S.gone[part] = 1;
+				continue;
+			}
+
+			int id = coord2id(G, i.r.x, i.r.y);
+			int b = local_box(id);
+			if (b >= 0)
+			{
+				S.cell[part] = b;
+				S.start[b + 1]++;
+			}
+
+			// The halo only holds the particles that cross up to
+			// sweep_travel columns, every particle is checked by its tile
+			if (S.owned[part] && (b < 0 || abs(id % nx - S.column[part]) > sweep_travel))
+				S.escaped = S.origin[part];
+		}
+
+		// Counting sort into the boxes
+		for (int b = 0; b < boxes; ++b)
+			S.start[b + 1] += S.start[b];
+
+		S.fill.assign(S.start.begin(), S.start.end() - 1);
+		for (size_t part = 0; part < S.p.size(); ++part)
+			if (S.cell[part] >= 0)
+			{
+				particle &i = S.p[part];
+				i.pF = i.F;
+				i.F = vec(0, 0);
+				add_wall_force(i, G);
+
+				S.order[S.fill[S.cell[part]]++] = part;
+			}
+
+		// Pair forces within the boxes and with the half shell
+		for (int b = 0; b < boxes; ++b)
+		{
+			int begin = S.start[b];
+			int end = S.start[b + 1];
+			if (begin == end)
+				continue;
+
+			for (int k1 = begin; k1 < end; ++k1)
+				for (int k2 = k1 + 1; k2 < end; ++k2)
+					pair_force(S.p[S.order[k1]], S.p[S.order[k2]], 0);
+
+			for (auto &offset : D.stencil)
+			{
+				scalar shift;
+				int nb = neighbor(b, offset, shift);
+				if (nb < 0)
+					continue;
+
+				for (int k1 = begin; k1 < end; ++k1)
+					for (int k2 = S.start[nb]; k2 < S.start[nb + 1]; ++k2)
+						pair_force(S.p[S.order[k1]], S.p[S.order[k2]], shift);
+			}
+		}
+
+		// Kick
+		for (size_t part = 0; part < S.p.size(); ++part)
+			if (S.cell[part] >= 0 && !initial)
+				S.p[part].v += 0.5 * dt * (S.p[part].F + S.p[part].pF);
+	}
+
+	// Only the particles of the tile itself are exact
+	for (size_t part = 0; part < S.p.size(); ++part)
+	{
+		if (!S.owned[part])
+			continue;
+
+		const particle &i = S.p[part];
+		next[S.origin[part]] = i;
+		if (S.gone[part])
+			S.removed.push_back(S.origin[part]);
+		else
+			S.speed2 = max(S.speed2, i.v.x * i.v.x + i.v.y * i.v.y);
+	}
+}
+
+int Simulation::choose_level(size_t part, size_t tick) const
+{
+	const particle &i = p[part];
+
+	// Longest step that moves the particle at most block_distance, by its
+	// speed as well as by its acceleration. A fast neighbor closes in on
+	// the particle just as well as its own speed.
+	scalar v = max(sqrt(i.v.x * i.v.x + i.v.y * i.v.y), closing[part]);
+	scalar a = sqrt(i.F.x * i.F.x + i.F.y * i.F.y);
+
+	scalar longest = min(P.block_distance / max(v, scalar(1e-300)), sqrt(2 * P.block_distance / max(a, scalar(1e-300))));
+
+	// A particle can only go to a coarser level at a tick where a step of
+	// that level begins
+	int k = 0;
+	while (k + 1 < P.block_levels && P.dt * (1 << (k + 1)) <= longest && tick % (size_t(1) << (k + 1)) == 0)
+		++k;
+
+	return k;
+}
+
+void Simulation::build_shell()
+{
+	// The jobs hold every pair of neighboring boxes once, with the shift of
+	// the second box next to the first
+	shell.assign(box.size(), vector<pair<int, scalar>>());
+
+	for (auto &phase : D.jobs)
+		for (auto &J : phase)
+			for (int k = 0; k < J.count; ++k)
+			{
+				shell[J.origin].push_back(make_pair(J.id[k], J.shift[k]));
+				shell[J.id[k]].push_back(make_pair(J.origin, -J.shift[k]));
+			}
+}
+
+void Simulation::block_force()
+{
+	if (shell.empty())
+		build_shell();
+
+	size_t tick = steps + 1;
+
+	// Every active particle sums up the forces of all its neighbors itself,
+	// so no two threads write to the same particle and there are no phases.
+	// Inactive particles keep the force of their last evaluation.
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int b = 0; b < int(box.size()); ++b)
+	{
+		for (auto i1 : box[b])
+		{
+			if (tick % (size_t(1) << level[i1]) != 0)
+				continue;
+
+			particle &i = p[i1];
+			i.pF = i.F;
+			i.F = vec(0, 0);
+			add_wall_force(i, walls.G);
+
+			vec F(0, 0);
+			scalar v2 = 0;
+
+			// Force of the particle at distance delta, and the largest
+			// relative speed of the interacting particles
+			auto interact = [&](int i2, scalar deltax, scalar deltay) {
+				scalar r = sqrt(deltax * deltax + deltay * deltay);
+				scalar f = lennard_jones(r);
+
+				if (f != 0)
+				{
+					F += vec(-f * deltax / r, -f * deltay / r);
+
+					scalar dvx = i.v.x - p[i2].v.x;
+					scalar dvy = i.v.y - p[i2].v.y;
+					v2 = max(v2, dvx * dvx + dvy * dvy);
+				}
+			};
+
+			for (auto i2 : box[b])
+				if (i2 != i1)
+					interact(i2, i.r.x - p[i2].r.x, i.r.y - p[i2].r.y);
+
+			// Positions of the neighbors' images next to this box
+			for (auto &n : shell[b])
+				for (auto i2 : box[n.first])
+					interact(i2, i.r.x - p[i2].r.x, i.r.y - (p[i2].r.y + n.second));
+
+			i.F += F;
+			closing[i1] = sqrt(v2);
+		}
+	}
+}
+
+void Simulation::block_kick(bool coarse)
+{
+	size_t tick = steps + 1;
+
+#pragma omp parallel
+	{
+		coarse_fields local;
+		if (coarse)
+			local = coarse_fields(P.width, P.height, P.field_nx, P.field_ny);
+
+#pragma omp for schedule(static)
+		for (size_t part = 0; part < p.size(); ++part)
+		{
+			particle &i = p[part];
+
+			if (tick % (size_t(1) << level[part]) == 0)
+			{
+				// Close the old step, choose the next one and open it
+				i.v += 0.5 * (P.dt * (1 << level[part])) * i.F;
+				level[part] = choose_level(part, tick);
+				i.v += 0.5 * (P.dt * (1 << level[part])) * i.F;
+			}
+
+			if (coarse)
+				local.add(i);
+		}
+
+		if (coarse)
+		{
+#pragma omp critical(field_merge)
+			fields.merge(local);
+		}
+	}
+
+	if (coarse)
+		fields.samples++;
+}
+
+scalar Simulation::kinetic_energy() const
+{
+	scalar E = 0;
+
+#pragma omp parallel for schedule(static) reduction(+ : E)
+	for (size_t i = 0; i < p.size(); ++i)
+		E += 0.5 * (p[i].v.x * p[i].v.x + p[i].v.y * p[i].v.y);
+
+	return E;
+}
+
+scalar Simulation::potential_energy() const
+{
+	scalar E = 0;
+
+	// Every pair is in exactly one job, like in the force calculation
+	for (auto &phase : D.jobs)
+	{
+#pragma omp parallel for schedule(dynamic, 16) reduction(+ : E)
+		for (size_t j = 0; j < phase.size(); ++j)
+		{
+			const job &J = phase[j];
+			const vector<int> &origin = box[J.origin];
+
+			for (size_t a = 0; a < origin.size(); ++a)
+			{
+				const particle &i = p[origin[a]];
+
+				if (J.self)
+					for (size_t b = a + 1; b < origin.size(); ++b)
+					{
+						scalar dx = i.r.x - p[origin[b]].r.x;
+						scalar dy = i.r.y - p[origin[b]].r.y;
+						E += lennard_jones_potential(sqrt(dx * dx + dy * dy));
+					}
+
+				for (int k = 0; k < J.count; ++k)
+					for (auto idx : box[J.id[k]])
+					{
+						scalar dx = i.r.x - p[idx].r.x;
+						scalar dy = i.r.y - J.shift[k] - p[idx].r.y;
+						E += lennard_jones_potential(sqrt(dx * dx + dy * dy));
+					}
+			}
+		}
+	}
+
+#pragma omp parallel for schedule(static) reduction(+ : E)
+	for (size_t idx = 0; idx < p.size(); ++idx)
+	{
+		const vec &r = p[idx].r;
+		E += west_wall::potential(r.x) + east_wall::potential(G.width - r.x) + south_wall::potential(r.y) +
+			 north_wall::potential(G.height - r.y);
+	}
+
+	return E;
+}
+
+scalar Simulation::max_speed() const
+{
+	scalar v2 = 0;
+
+#pragma omp parallel for schedule(static) reduction(max : v2)
+	for (size_t i = 0; i < p.size(); ++i)
+		v2 = max(v2, p[i].v.x * p[i].v.x + p[i].v.y * p[i].v.y);
+
+	return sqrt(v2);
+}
+
+void Simulation::report(int error) const
+{
+	report_particle(p, failed, steps, P.check_interval, error);
+
+	if (!P.dump_file.empty())
+		dump_state(p, steps, P.dump_file.c_str());
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include <vector>
+#include <random>
+#include "common.h"
+#include "parameters.h"
+#include "force.h"
+#include "particle.h"
+#include "Dispatcher.h"
+#include "boundary.h"
+#include "numa.h"
+#include "quadtree.h"
+#include "rdf.h"
+#include "fields.h"
+
+using namespace std;
+
+// Scratch space of a thread for the temporal blocking: copies of the
+// particles of a tile and its halo, sorted into the boxes of their columns
+struct sweep_tile
+{
+	particle_list p;
+
+	// Index of every copy in the system, and whether it belongs to the tile
+	// itself (only these are written back) or to the halo
+	vector<int> origin;
+	vector<char> owned;
+
+	// Box column every copy started the sweep in
+	vector<int> column;
+
+	// Copies removed by a wall policy
+	vector<char> gone;
+
+	// Local box of every copy (-1 if it is in none), and the copies sorted
+	// by box: box b holds order[start[b]] to order[start[b + 1] - 1]. The
+	// boxes are numbered row by row within the columns of the copies.
+	vector<int> cell;
+	vector<int> order;
+	vector<int> start;
+	vector<int> fill;
+
+	// Particles of the tiles done by the thread that were removed, and one
+	// that left its halo or crossed more columns than the halo allows (-1
+	// if none did)
+	vector<int> removed;
+	int escaped = -1;
+
+	// Largest squared speed of the particles of the tiles after the sweep
+	scalar speed2 = 0;
+};
+
+// One simulated system: parameters, particles, boxes, dispatcher and walls.
+// Systems are completely independent of each other, so a program can run
+// any number of them (see ensemble.h).
+struct Simulation
+{
+	// Parameters of the system and the box grid derived from them
+	parameters P;
+	grid G;
+
+	// The particles
+	particle_list p;
+
+	// Ids of the particles in every box
+	vector<vector<int>> box;
+
+	// Jobs of the pair force calculation
+	Dispatcher D;
+
+	// Boxes along the walls
+	Boundaries walls;
+
+	// Particle strips of the threads (if P.use_numa_layout is set)
+	numa_layout L;
+
+	// Adaptive boxes (if P.adaptive is set). The boxes are its leaves then.
+	quadtree Q;
+
+	// Box of every particle, as of the last rebin (uniform grid only)
+	vector<int> cell;
+
+	// Particles that changed box in the drift, found by every thread
+	vector<vector<int>> movers;
+
+	// Pair distances of the sampled steps (if P.rdf_interval is set)
+	rdf_histogram rdf;
+
+	// Coarse grained fields of the sampled steps (if P.field_interval is
+	// set)
+	coarse_fields fields;
+
+	// Time step level of every particle (if P.block_levels > 1): particle i
+	// moves in steps of dt * 2^level[i], its step ends at the ticks (steps
+	// since the start) that are multiples of that.
+	vector<int> level;
+
+	// Largest relative speed of a particle and the particles it interacted
+	// with at its last force evaluation
+	vector<scalar> closing;
+
+	// All neighbor boxes of every box, with the shift of their periodic
+	// image, for the force on single particles. Built from the jobs.
+	vector<vector<pair<int, scalar>>> shell;
+
+	// Particles the walls removed in the last step
+	vector<int> removed_ids;
+
+	// Per thread scratch space of the temporal blocking (if
+	// P.temporal_block > 1), and the particles as of the end of a sweep
+	vector<sweep_tile> sweeps;
+	particle_list next;
+
+	// Box columns a particle may cross within a sweep, the part of the
+	// halo for the particles moving in. It follows from the largest speed
+	// after the last sweep (sweep_speed, negative before the first one).
+	int sweep_travel = 1;
+	scalar sweep_speed = -1;
+
+	// Out of core (if P.out_of_core_dir is set): p and next are files, and
+	// the particles of box column x are p[column_start[x]] to
+	// p[column_start[x + 1] - 1]. There are no box lists and jobs then.
+	vector<size_t> column_start;
+
+	// Per thread tiles of the tiled kernel, kept from step to step. Per box
+	// dependency tokens and wall flags of the task graph (if P.task_graph is
+	// set).
+	vector<job_tiles> tiles;
+	vector<char> box_token;
+	vector<char> wall_box;
+
+	// Physical time
+	scalar T = 0;
+
+	// Number of steps done, used for the invariant checks
+	size_t steps = 0;
+
+	// Index of the particle that failed an invariant check
+	size_t failed = 0;
+
+	// Random numbers for the initial state
+	mt19937 rng;
+
+	// Create the system: particles on the grid of initial positions with
+	// random velocities, sorted into the boxes, with initial forces.
+	// Throws the error codes of the Dispatcher if the domain doesn't fit
+	// the box grid.
+	Simulation(const parameters &system);
+
+	// Do n velocity verlet steps. Throws the error codes of check.h if an
+	// invariant check fails, 'failed' is the offending particle then.
+	void step(size_t n = 1);
+
+	// Access to the state
+	const particle_list &particles() const
+	{
+		return p;
+	}
+
+	scalar time() const
+	{
+		return T;
+	}
+
+	// Total kinetic energy (unit masses)
+	scalar kinetic_energy() const;
+
+	// Largest speed of all particles
+	scalar max_speed() const;
+
+	// Potential energy of all pairs and walls, from the box lists and jobs
+	// (not for systems kept out of core)
+	scalar potential_energy() const;
+
+	// Print the failed check to the terminal and dump the state if
+	// requested by the parameters
+	void report(int error) const;
+
+	// Drift all particles by tau, noting the ones that left their box in
+	// 'movers' if the boxes are updated incrementally. The multiple time
+	// step scheme does its first pair force half kick and the wall force
+	// substeps here as well.
+	void drift(bool incremental, scalar tau);
+	void drift_particle(size_t part, bool incremental, vector<int> &moved, scalar tau);
+	void respa_drift(particle &i, scalar tau) const;
+
+	// Apply the wall policies after a drift and update the boxes. With
+	// 'checks' the invariants are checked (every check_interval steps) and
+	// the NUMA strips sorted (every numa_sort_interval steps).
+	void update_boxes(bool incremental, bool checks);
+
+	// Kick all particles by tau, sampling the coarse fields if requested
+	void kick(scalar tau, bool coarse);
+
+	// A step of the splitting schemes of higher order (see integrator.h)
+	void step_splitting(bool incremental, bool sample, bool coarse);
+
+	// Forces and kick of a step as a task graph instead of barrier
+	// separated phases: a box is kicked as soon as all jobs writing into it
+	// are done, and drifted for the next step right away if drift_next is
+	// set. sample and coarse request the g(r) and field samples.
+	void step_tasks(bool sample, bool coarse, bool drift_next);
+
+	// Block time steps: the level a particle should use for its next step,
+	// which begins at 'tick'
+	int choose_level(size_t part, size_t tick) const;
+
+	// Forces on the particles whose step ends with the current step, and
+	// their closing and opening kicks. coarse requests the field sample.
+	void block_force();
+	void block_kick(bool coarse);
+	void build_shell();
+
+	// Temporal blocking: advance all tiles n steps, one at a time per
+	// thread (a sweep), writing the results to 'next'. n = 0 only
+	// calculates the forces.
+	void sweep(size_t n);
+	void advance_tile(sweep_tile &S, int first, int last, size_t n);
+
+	bool out_of_core() const
+	{
+		return !P.out_of_core_dir.empty();
+	}
+
+	// Copy the particles of next to p sorted by box column, without the
+	// removed_ids (out of core only)
+	void sort_columns();
+
+	// Give the particles their initial positions and velocities
+	void init_particles();
+
+	// Sort the particles into the boxes
+	void rebin();
+
+	// Move the particles that changed box since the last rebin to their new
+	// box (incremental rebinning). 'movers' has to hold all of them, or
+	// more.
+	void move_particles();
+
+	// Recreate the adaptive boxes for the current particles, with their
+	// jobs and walls
+	void rebuild_tree();
+};
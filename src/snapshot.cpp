@@ -0,0 +1,220 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+
+using namespace std;
+
+// Layout version, to be raised with every change of snapshot_header,
+// snapshot_slot or particle
+static const uint32_t snapshot_version = 1;
+
+// Slots and arrays start at cache line boundaries
+static uint64_t round_up(uint64_t bytes)
+{
+	return (bytes + 63) / 64 * 64;
+}
+
+string snapshot_segment(int64_t pid)
+{
+	return "/gas_state." + to_string(pid);
+}
+
+bool snapshot_publisher::open(const string &segment, scalar width, scalar height, int boxes_x, int boxes_y,
+							  bool adaptive, size_t capacity, size_t cell_capacity)
+{
+	close();
+
+	// Header, then per slot the particles and the cell offsets
+	uint64_t particle_bytes = round_up(capacity * sizeof(particle));
+	uint64_t cell_bytes = round_up((cell_capacity + 1) * sizeof(uint64_t));
+	uint64_t header_bytes = round_up(sizeof(snapshot_header));
+	uint64_t size = header_bytes + 2 * (particle_bytes + cell_bytes);
+
+	int fd = shm_open(segment.c_str(), O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		cerr << "Can't create the state segment " << segment << ": " << strerror(errno) << endl;
+		return false;
+	}
+
+	void *memory = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+	// The mapping stays valid without the descriptor
+	::close(fd);
+
+	if (memory == MAP_FAILED)
+	{
+		cerr << "Can't map the state segment " << segment << ": " << strerror(errno) << endl;
+		shm_unlink(segment.c_str());
+		return false;
+	}
+
+	header = ::new (memory) snapshot_header();
+	memcpy(header->magic, "GASSTATE", 8);
+	header->version = snapshot_version;
+	header->header_size = sizeof(snapshot_header);
+	header->segment_size = size;
+	header->particle_size = sizeof(particle);
+	header->scalar_size = sizeof(scalar);
+	strcpy(header->layout, "r.x r.y v.x v.y F.x F.y pF.x pF.y");
+	header->width = width;
+	header->height = height;
+	header->boxes_x = boxes_x;
+	header->boxes_y = boxes_y;
+	header->adaptive = adaptive;
+	header->capacity = capacity;
+	header->cell_capacity = cell_capacity;
+	header->generation.store(0);
+
+	for (int k = 0; k < 2; ++k)
+	{
+		snapshot_slot &s = header->slot[k];
+		s.sequence.store(0);
+		s.generation = s.steps = s.particles = s.cells = 0;
+		s.time = 0;
+		s.particle_offset = header_bytes + k * (particle_bytes + cell_bytes);
+		s.cell_offset = s.particle_offset + particle_bytes;
+	}
+
+	name = segment;
+
+	return true;
+}
+
+void snapshot_publisher::publish(const particle_list &p, const vector<vector<int>> &box, size_t steps, scalar time)
+{
+	if (!header)
+		return;
+
+	char *base = reinterpret_cast<char *>(header);
+
+	// The readers are on the latest snapshot, the other slot is free
+	uint64_t generation = header->generation.load(memory_order_relaxed) + 1;
+	snapshot_slot &s = header->slot[(generation - 1) % 2];
+	particle *to = reinterpret_cast<particle *>(base + s.particle_offset);
+	uint64_t *offsets = reinterpret_cast<uint64_t *>(base + s.cell_offset);
+
+	size_t cells = box.size();
+	if (cells > header->cell_capacity || p.size() > header->capacity)
+	{
+		cerr << "State snapshot of " << p.size() << " particles in " << cells << " cells doesn't fit the segment, skipped"
+			 << endl;
+		return;
+	}
+
+	// Odd sequence: readers of this slot know their copy may be torn
+	uint64_t sequence = s.sequence.load(memory_order_relaxed);
+	s.sequence.store(sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	uint64_t count = 0;
+	for (size_t c = 0; c < cells; ++c)
+	{
+		offsets[c] = count;
+		count += box[c].size();
+	}
+	offsets[cells] = count;
+
+#pragma omp parallel for schedule(dynamic, 64)
+	for (size_t c = 0; c < cells; ++c)
+	{
+		particle *out = to + offsets[c];
+		for (int i : box[c])
+			*out++ = p[i];
+	}
+
+	s.generation = generation;
+	s.steps = steps;
+	s.time = time;
+	s.particles = count;
+	s.cells = cells;
+
+	s.sequence.store(sequence + 2, memory_order_release);
+	header->generation.store(generation, memory_order_release);
+}
+
+void snapshot_publisher::close()
+{
+	if (!header)
+		return;
+
+	munmap(header, header->segment_size);
+	shm_unlink(name.c_str());
+	header = nullptr;
+}
+
+const snapshot_header *attach_snapshots(const string &segment)
+{
+	int fd = shm_open(segment.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat info;
+	void *memory = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && size_t(info.st_size) >= sizeof(snapshot_header))
+		memory = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (memory == MAP_FAILED)
+		return nullptr;
+
+	const snapshot_header *header = static_cast<const snapshot_header *>(memory);
+	if (memcmp(header->magic, "GASSTATE", 8) != 0 || header->version != snapshot_version ||
+		header->segment_size != uint64_t(info.st_size))
+	{
+		munmap(memory, info.st_size);
+		return nullptr;
+	}
+
+	return header;
+}
+
+void detach_snapshots(const snapshot_header *header)
+{
+	munmap(const_cast<snapshot_header *>(header), header->segment_size);
+}
+
+bool read_snapshot(const snapshot_header *header, vector<particle> &particles, vector<uint64_t> &offsets,
+				   uint64_t &steps, double &time)
+{
+	const char *base = reinterpret_cast<const char *>(header);
+
+	while (true)
+	{
+		uint64_t generation = header->generation.load(memory_order_acquire);
+		if (generation == 0)
+			return false;
+
+		const snapshot_slot &s = header->slot[(generation - 1) % 2];
+		uint64_t before = s.sequence.load(memory_order_acquire);
+
+		if (before % 2 == 0)
+		{
+			// Sizes are clamped, they may be torn as well
+			size_t count = min(s.particles, header->capacity);
+			size_t cells = min(s.cells, header->cell_capacity);
+			const particle *from = reinterpret_cast<const particle *>(base + s.particle_offset);
+			const uint64_t *cell_offsets = reinterpret_cast<const uint64_t *>(base + s.cell_offset);
+
+			particles.assign(from, from + count);
+			offsets.assign(cell_offsets, cell_offsets + cells + 1);
+			steps = s.steps;
+			time = s.time;
+			atomic_thread_fence(memory_order_acquire);
+
+			if (s.sequence.load(memory_order_relaxed) == before)
+				return true;
+		}
+
+		// The slot is being overwritten, the next one is complete soon
+		usleep(1);
+	}
+}
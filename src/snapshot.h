@@ -0,0 +1,126 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "common.h"
+#include "particle.h"
+
+using namespace std;
+
+// STATE EXPORT
+// A running simulation can publish its particles at every diagnostic output
+// to the POSIX shared memory segment /gas_state.<pid>, where analysis
+// programs in any language map them instead of reading dump files. The
+// segment is self describing: a header with the layout, followed by two
+// slots that take turns, so the latest complete snapshot stays readable
+// while the next one is written. Every slot holds the particles grouped by
+// box, and the offsets of the boxes.
+//
+// Reading a snapshot: load 'generation' (0: nothing published yet), the
+// latest is in slot (generation - 1) % 2. Note its 'sequence', which is
+// even unless the slot is being written, use the particles, and check that
+// the sequence didn't change meanwhile. If it did, the slot was
+// overwritten (the reader was slower than two diagnostic outputs) and has
+// to be read again. All numbers are in the byte order of the machine.
+
+// Snapshot in one slot
+struct snapshot_slot
+{
+	// Odd while the slot is being written
+	atomic<uint64_t> sequence;
+
+	// Number of the snapshot (1 for the first one published)
+	uint64_t generation;
+
+	// Steps done and physical time
+	uint64_t steps;
+	double time;
+
+	uint64_t particles;
+	uint64_t cells;
+
+	// Position of the particles (particle_size bytes each) and of the cell
+	// offsets (cells + 1 uint64_t) from the start of the segment. The
+	// particles of cell c are particles offsets[c] to offsets[c + 1] - 1.
+	uint64_t particle_offset;
+	uint64_t cell_offset;
+};
+
+// Start of the segment
+struct snapshot_header
+{
+	// "GASSTATE" (not terminated) and the layout version
+	char magic[8];
+	uint32_t version;
+
+	// Size of this header and of the whole segment in bytes
+	uint32_t header_size;
+	uint64_t segment_size;
+
+	// A particle is particle_size bytes, the scalars named in 'layout'
+	// (space separated, zero terminated) in this order, scalar_size bytes
+	// each. Bytes beyond them are padding.
+	uint32_t particle_size;
+	uint32_t scalar_size;
+	char layout[64];
+
+	// Domain and box grid. With adaptive boxes (adaptive = 1) the cells are
+	// the leaves of the quadtree, otherwise box x, y is cell
+	// x + y * boxes_x.
+	double width;
+	double height;
+	int32_t boxes_x;
+	int32_t boxes_y;
+	int32_t adaptive;
+
+	// Room of every slot
+	uint64_t capacity;
+	uint64_t cell_capacity;
+
+	// Snapshots published so far
+	atomic<uint64_t> generation;
+
+	snapshot_slot slot[2];
+};
+
+// Name of the segment of a simulation, "/gas_state.<pid>"
+string snapshot_segment(int64_t pid);
+
+// Writing side, owned by the simulation
+struct snapshot_publisher
+{
+	snapshot_header *header = nullptr;
+	string name;
+
+	// Create the segment for up to 'capacity' particles in 'cell_capacity'
+	// cells of the given domain. Returns false (after telling why) if that
+	// fails, publish() does nothing then.
+	bool open(const string &segment, scalar width, scalar height, int boxes_x, int boxes_y, bool adaptive,
+			  size_t capacity, size_t cell_capacity);
+
+	// Copy the particles of all boxes into the slot not holding the latest
+	// snapshot, in parallel, and make it the latest. Only one thread may
+	// publish. Snapshots that don't fit are skipped with a message.
+	void publish(const particle_list &p, const vector<vector<int>> &box, size_t steps, scalar time);
+
+	// Unmap and remove the segment
+	void close();
+
+	~snapshot_publisher()
+	{
+		close();
+	}
+};
+
+// Reading side: map an existing segment read only. Returns nullptr if there
+// is none or it isn't a snapshot segment of this layout version.
+const snapshot_header *attach_snapshots(const string &segment);
+
+// Unmap a segment mapped by attach_snapshots
+void detach_snapshots(const snapshot_header *header);
+
+// Copy the latest snapshot, retrying while it is overwritten. Returns false
+// if nothing was published yet.
+bool read_snapshot(const snapshot_header *header, vector<particle> &particles, vector<uint64_t> &offsets,
+				   uint64_t &steps, double &time);
@@ -0,0 +1,958 @@
+// Validation of the force calculation. Every kernel and scheduling variant
+// is compared particle by particle against the O(N^2) reference in oracle.h,
+// on random configurations, and energy conservation is checked on short
+// runs. Returns 0 if everything passed.
+//
+// The boundary conditions are fixed at compile time (boundary.h), so
+// 'make check' builds and runs this program for several of them.
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <random>
+#include <algorithm>
+#include <string>
+#include <unistd.h>
+#include "common.h"
+#include "particle.h"
+#include "force.h"
+#include "Dispatcher.h"
+#include "dispatch.h"
+#include "grid.h"
+#include "boundary.h"
+#include "numa.h"
+#include "oracle.h"
+#include "quadtree.h"
+#include "simulation.h"
+#include "snapshot.h"
+#include "check.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+
+// Grids every check runs on: (width, height, subdivision). They cover
+// boxes smaller and larger than the cutoff, stretched boxes, and leftover
+// rows at the periodic boundary, and stencils too large for a single job.
+const scalar grids[][3] = {{5, 5, 1}, {5, 5, 2}, {9.5, 7.3, 3}, {3, 11, 2}, {8, 4, 2}, {6, 6, 1}, {7, 6, 4}};
+
+// Largest number of threads the variants run with
+#ifdef _OPENMP
+const int max_threads = 3;
+#else
+const int max_threads = 1;
+#endif
+
+// Largest initial velocity
+const scalar velocity_max = 2;
+
+// Step size for the energy check
+const scalar dt = 1e-4;
+
+// Largest accepted force error, relative to the sum of the magnitudes of
+// all contributions to a particle
+const scalar force_tolerance = 1e-10;
+
+// Largest accepted relative change of the total energy in a short run
+const scalar energy_tolerance = 1e-4;
+
+// Largest accepted difference of positions and velocities (relative to
+// the speed) of two runs that only differ in the order of the summation
+const scalar trajectory_tolerance = 1e-8;
+
+// Bins of the pair distance histograms
+const int rdf_bins = 50;
+
+// Leaf capacity and depth of the adaptive boxes, small enough that the
+// trees get a couple of levels
+const int leaf_capacity = 3;
+const int max_depth = 3;
+
+// A way of calculating the forces
+struct variant
+{
+	const char *name;
+	force_kernel kernel;
+	bool numa;
+	bool adaptive;
+	int threads;
+};
+
+// Distance particles keep from non-periodic walls
+static scalar wall_margin(bool periodic)
+{
+	return periodic ? 0 : 0.05;
+}
+
+// Particles at uniformly random positions. They can get arbitrarily close,
+// which gives huge forces, but every pair has to be found nevertheless.
+static void random_gas(const grid &G, particle_list &p, size_t n, mt19937 &rng)
+{
+	scalar mx = wall_margin(false);
+	scalar my = wall_margin(north_wall::periodic);
+	uniform_real_distribution<scalar> ux(mx, G.width - mx);
+	uniform_real_distribution<scalar> uy(my, G.height - my);
+	uniform_real_distribution<scalar> uv(-velocity_max, velocity_max);
+
+	p.resize(n);
+	first_touch(p);
+
+	for (auto &i : p)
+	{
+		i.r = vec(ux(rng), uy(rng));
+		i.v = vec(uv(rng), uv(rng));
+	}
+}
+
+// A random gas with a dense cluster: half of the particles are packed into a
+// small square, so box occupations differ by orders of magnitude
+static void clustered_gas(const grid &G, particle_list &p, size_t n, mt19937 &rng)
+{
+	random_gas(G, p, n, rng);
+
+	scalar size = 0.4;
+	uniform_real_distribution<scalar> ux(0.1, G.width - size - 0.1);
+	uniform_real_distribution<scalar> uy(0.1, G.height - size - 0.1);
+	uniform_real_distribution<scalar> u(0, size);
+
+	scalar x0 = ux(rng);
+	scalar y0 = uy(rng);
+
+	for (size_t i = 0; i < n / 2; ++i)
+		p[i].r = vec(x0 + u(rng), y0 + u(rng));
+}
+
+// Particles on a square lattice with a little noise, a realistic liquid
+// like configuration with moderate forces
+static void jittered_lattice(const grid &G, particle_list &p, scalar spacing, mt19937 &rng)
+{
+	uniform_real_distribution<scalar> jitter(-0.05 * spacing, 0.05 * spacing);
+	uniform_real_distribution<scalar> uv(-velocity_max, velocity_max);
+
+	// Keep a distance of one spacing from non-periodic walls
+	scalar y0 = north_wall::periodic ? 0.5 * spacing : spacing;
+
+	int nx = int((G.width - spacing) / spacing);
+	int ny = int((G.height - (north_wall::periodic ? 0 : spacing)) / spacing);
+
+	p.resize(max(nx, 0) * max(ny, 0));
+	first_touch(p);
+
+	for (int y = 0; y < ny; ++y)
+		for (int x = 0; x < nx; ++x)
+		{
+			particle &i = p[x + y * nx];
+			i.r = vec((x + 1) * spacing + jitter(rng), y0 + y * spacing + jitter(rng));
+			i.v = vec(uv(rng), uv(rng));
+		}
+}
+
+// Set up dispatcher, walls and boxes for a variant. The NUMA layout
+// reorders the particles.
+static void prepare(const variant &V, const grid &G, particle_list &p, vector<vector<int>> &box, numa_layout &L,
+					quadtree &Q, Dispatcher &D, Boundaries &walls)
+{
+#ifdef _OPENMP
+	omp_set_num_threads(V.threads);
+#endif
+
+	box.assign(G.num_boxes, vector<int>());
+
+	if (V.adaptive)
+	{
+		Q = quadtree(G.width, G.height, leaf_capacity, max_depth);
+		Q.build(p, box);
+		D.set_jobs(Q.create_jobs());
+		walls = Q.boundaries();
+	}
+	else if (V.numa)
+	{
+		L.create(G, p);
+		D.assign_owners(L);
+		L.rebin(p, box);
+	}
+	else
+	{
+		for (size_t i = 0; i < p.size(); ++i)
+			box[coord2id(G, p[i].r.x, p[i].r.y)].push_back(i);
+	}
+}
+
+// Largest relative difference of the forces of the particles from the
+// reference
+static scalar reference_error(const grid &G, const particle_list &p)
+{
+	vector<vec> F;
+	vector<scalar> scale;
+	reference_force(G, p, F, scale);
+
+	scalar error = 0;
+	for (size_t i = 0; i < p.size(); ++i)
+	{
+		scalar e = (abs(p[i].F.x - F[i].x) + abs(p[i].F.y - F[i].y)) / max(scale[i], scalar(1));
+		error = max(error, e);
+	}
+
+	return error;
+}
+
+// Compare the forces of a variant with the reference. Returns the largest
+// relative error. The pair distances sampled on the way are compared as
+// well, 'rdf_errors' receives the number of pairs binned differently.
+static scalar force_error(const variant &V, const grid &G, const particle_list &p0, size_t &rdf_errors)
+{
+	particle_list p = p0;
+	vector<vector<int>> box;
+	numa_layout L;
+	quadtree Q;
+	Dispatcher D(G);
+	Boundaries walls(G);
+
+	prepare(V, G, p, box, L, Q, D, walls);
+
+	rdf_histogram H(rdf_bins);
+	update_force(p, box, D, walls, V.kernel, &H);
+
+	rdf_histogram R(rdf_bins);
+	reference_rdf(G, p, R);
+
+	rdf_errors = 0;
+	for (int b = 0; b < rdf_bins; ++b)
+		rdf_errors += max(H.counts[b], R.counts[b]) - min(H.counts[b], R.counts[b]);
+
+	return reference_error(G, p);
+}
+
+// Integrate a few steps with the velocity verlet scheme of gas.cpp and
+// return the relative change of the total energy
+static scalar energy_drift(const variant &V, const grid &G, const particle_list &p0, int steps)
+{
+	particle_list p = p0;
+	vector<vector<int>> box;
+	numa_layout L;
+	quadtree Q;
+	Dispatcher D(G);
+	Boundaries walls(G);
+
+	prepare(V, G, p, box, L, Q, D, walls);
+	update_force(p, box, D, walls, V.kernel);
+
+	scalar E0 = kinetic_energy(p) + potential_energy(G, p);
+
+	for (int step = 0; step < steps; ++step)
+	{
+#pragma omp parallel for schedule(static)
+		for (size_t part = 0; part < p.size(); ++part)
+			p[part].r += dt * p[part].v + 0.5 * dt * dt * p[part].F;
+
+		if (cross_walls(p, box, walls) && V.numa)
+			L.sort(p);
+
+		if (V.adaptive)
+			Q.rebin(p, box);
+		else if (V.numa)
+			L.rebin(p, box);
+		else
+		{
+			for (auto &b : box)
+				b.clear();
+			for (size_t i = 0; i < p.size(); ++i)
+				box[coord2id(G, p[i].r.x, p[i].r.y)].push_back(i);
+		}
+
+		update_force(p, box, D, walls, V.kernel);
+
+#pragma omp parallel for schedule(static)
+		for (size_t part = 0; part < p.size(); ++part)
+			p[part].v += 0.5 * dt * (p[part].F + p[part].pF);
+	}
+
+	scalar E1 = kinetic_energy(p) + potential_energy(G, p);
+
+	return abs(E1 - E0) / max(abs(E0), scalar(1));
+}
+
+// Parameters of the simulations the checks run on grid G, on 'threads'
+// threads (which also become the thread count of the following parallel
+// regions). The particles start on a grid of the given spacing filling the
+// domain, with fast velocities, and the boxes (and trees) are rebuilt a
+// couple of times in the short runs. Its rows keep the distance of the
+// initial layout from non-periodic walls.
+static parameters simulation_parameters(const grid &G, int threads, scalar spacing = 1.2)
+{
+	set_thread_count(threads);
+
+	parameters P;
+	P.width = G.width;
+	P.height = G.height;
+	P.box_subdivision = G.box_subdivision;
+	P.grid_w = max(int((G.width - 2 * pot_size) / spacing), 1);
+	P.grid_h = north_wall::periodic ? max(int(G.height / spacing) - 1, 1)
+									: max(int((G.height - 2 * pot_size) / spacing), 1);
+	P.N = P.grid_w * P.grid_h;
+	P.dt = dt;
+	P.velocity_max = 20;
+	P.seed = 2017;
+	P.threads = threads;
+	P.leaf_capacity = leaf_capacity;
+	P.max_depth = max_depth;
+	P.rebuild_interval = 7;
+	P.tree_interval = 7;
+	P.dump_file = "";
+
+	return P;
+}
+
+// Print the outcome of a check, which passes if 'value' is below 'limit',
+// and count it in 'failures' if it didn't
+static void report(const string &name, scalar value, scalar limit, int &failures)
+{
+	bool pass = value < limit;
+	failures += !pass;
+
+	cout << (pass ? "  ok   " : "  FAIL ") << name << " " << value << endl;
+}
+
+// Build a simulation from its parameters alone, with its own initial
+// layout, and run a few steps. Returns the number of particles that start
+// closer to a non-periodic wall than the wall potential's minimum, plus one
+// if a particle is broken after the steps (all of them if a step throws).
+static size_t layout_errors(const grid &G)
+{
+	parameters P = simulation_parameters(G, 1);
+	Simulation S(P);
+
+	size_t errors = 0;
+	for (auto &i : S.p)
+	{
+		scalar dx = min(i.r.x, G.width - i.r.x);
+		scalar dy = north_wall::periodic ? pot_size : min(i.r.y, G.height - i.r.y);
+		errors += min(dx, dy) < pot_size * (1 - 1e-9);
+	}
+
+	try
+	{
+		for (int step = 0; step < 20; ++step)
+			S.step();
+	}
+	catch (int e)
+	{
+		S.report(e);
+		return S.p.size();
+	}
+
+	size_t index;
+	if (check_particles(G, S.p, index))
+		++errors;
+
+	return errors;
+}
+
+// Run a complete simulation with incremental rebinning and compare its
+// boxes with freshly sorted ones. Returns the number of particles found in
+// a wrong box (or missing), summed over all steps.
+static size_t misplaced_particles(const grid &G, bool numa, int threads)
+{
+	// Rebinning is only incremental in between rebuilds
+	parameters P = simulation_parameters(G, threads);
+	P.use_numa_layout = numa;
+	P.rebuild_interval = 10000;
+	P.numa_sort_interval = 10000;
+
+	Simulation S(P);
+
+	// Boxes have to be right after every step, the drift would notice a
+	// wrong box of a particle in the next step and hide the error
+	size_t misplaced = 0;
+	vector<vector<int>> box(G.num_boxes);
+
+	for (int step = 0; step < 2000; ++step)
+	{
+		try
+		{
+			S.step();
+		}
+		catch (int e)
+		{
+			S.report(e);
+			return S.p.size();
+		}
+
+		for (auto &b : box)
+			b.clear();
+		for (size_t i = 0; i < S.p.size(); ++i)
+			box[coord2id(G, S.p[i].r.x, S.p[i].r.y)].push_back(i);
+
+		for (int b = 0; b < G.num_boxes; ++b)
+		{
+			vector<int> ids = S.box[b];
+			sort(ids.begin(), ids.end());
+
+			vector<int> wrong;
+			set_symmetric_difference(ids.begin(), ids.end(), box[b].begin(), box[b].end(), back_inserter(wrong));
+			misplaced += wrong.size();
+		}
+	}
+
+	return misplaced;
+}
+
+// Run a simulation with the task graph and compare its forces with the
+// reference after every call of step(), which drifts inside the graph for
+// all but the last step. Returns the largest relative force error.
+static scalar task_graph_error(const grid &G, force_kernel kernel, bool adaptive, int threads)
+{
+	// Particles start a little closer than the cutoff, so all of them
+	// interact right away
+	parameters P = simulation_parameters(G, threads, 1);
+	P.kernel = kernel;
+	P.task_graph = true;
+	P.adaptive = adaptive;
+
+	scalar error = 0;
+
+	try
+	{
+		Simulation S(P);
+
+		for (int call = 0; call < 20; ++call)
+		{
+			S.step(5);
+			error = max(error, reference_error(G, S.p));
+		}
+	}
+	catch (int e)
+	{
+		return 1;
+	}
+
+	return error;
+}
+
+// Run a simulation with block time steps, where the particles of all levels
+// finish their step together every 2^(levels-1) steps, and compare the
+// forces with the reference then. Returns the largest error as in
+// force_error, 1 if the simulation failed or never used a coarse level.
+static scalar block_step_error(const grid &G, bool adaptive, int threads)
+{
+	parameters P = simulation_parameters(G, threads, 1);
+	P.adaptive = adaptive;
+	P.block_levels = 3;
+	// Slow particles take the longest steps, fast ones the shortest
+	P.block_distance = 1e-2;
+
+	scalar error = 0;
+	bool coarse = false;
+
+	try
+	{
+		Simulation S(P);
+
+		for (int call = 0; call < 20; ++call)
+		{
+			S.step(1 << (P.block_levels - 1));
+			error = max(error, reference_error(G, S.p));
+
+			for (auto l : S.level)
+				coarse = coarse || l > 0;
+		}
+	}
+	catch (int e)
+	{
+		return 1;
+	}
+
+	return coarse ? error : 1;
+}
+
+// Run a simulation with temporal blocking in narrow tiles next to one
+// without, and return the largest difference of the particles (see
+// trajectory_tolerance), 1 if a simulation failed. Out of core, the
+// particles are kept in files in the working directory, and compared in
+// the order of their x coordinate since the sweeps sort them.
+static scalar temporal_error(const grid &G, int threads, bool out_of_core)
+{
+	parameters P = simulation_parameters(G, threads, 1);
+	P.use_numa_layout = false;
+
+	scalar error = 0;
+
+	try
+	{
+		Simulation R(P);
+
+		P.temporal_block = 3;
+		P.tile_columns = 2;
+		if (out_of_core)
+			P.out_of_core_dir = ".";
+		Simulation S(P);
+
+		auto by_x = [](const particle &a, const particle &b) { return a.r.x < b.r.x; };
+
+		// Sweeps of all lengths up to temporal_block
+		for (int call = 0; call < 20; ++call)
+		{
+			R.step(7);
+			S.step(7);
+
+			if (S.p.size() != R.p.size())
+				return 1;
+
+			particle_list a(S.p.begin(), S.p.end());
+			particle_list b(R.p.begin(), R.p.end());
+			if (out_of_core)
+			{
+				sort(a.begin(), a.end(), by_x);
+				sort(b.begin(), b.end(), by_x);
+			}
+
+			for (size_t i = 0; i < a.size(); ++i)
+			{
+				scalar v = max(abs(b[i].v.x) + abs(b[i].v.y), scalar(1));
+				scalar e = abs(a[i].r.x - b[i].r.x) + abs(a[i].r.y - b[i].r.y) +
+						   (abs(a[i].v.x - b[i].v.x) + abs(a[i].v.y - b[i].v.y)) / v;
+				error = max(error, e);
+			}
+		}
+	}
+	catch (int e)
+	{
+		return 1;
+	}
+
+	return error;
+}
+
+// Speed up a particle of a dilute run with temporal blocking so much that
+// it crosses many columns in the next sweep, far more than the halo sized
+// after the last sweep allows, and compare the forces after that sweep
+// with the reference. Returns the largest error as in force_error, 1 if
+// the simulation failed.
+static scalar fast_particle_error(const grid &G, int threads)
+{
+	parameters P = simulation_parameters(G, threads, 1.5);
+	P.velocity_max = velocity_max;
+	P.use_numa_layout = false;
+	P.temporal_block = 3;
+	P.tile_columns = 2;
+
+	try
+	{
+		Simulation S(P);
+		S.step(3);
+
+		// Between the first two rows of the initial grid, at the west end,
+		// heading east over 70% of the width in the sweep
+		particle &i = S.p[P.grid_w / 10];
+		i.r.y += 0.5 * P.height / (P.grid_h + 1);
+		i.v = vec(0.7 * G.width / (3 * P.dt), 0);
+		S.rebin();
+
+		S.step(3);
+		return reference_error(G, S.p);
+	}
+	catch (int e)
+	{
+		return 1;
+	}
+}
+
+// Sample the coarse fields of a short simulation in every step and compare
+// their totals with the particle sums. Returns the largest relative
+// difference of count, momentum and kinetic energy.
+static scalar field_error(const grid &G, int threads)
+{
+	parameters P = simulation_parameters(G, threads);
+	P.velocity_max = velocity_max;
+	P.field_interval = 1;
+	P.field_nx = 3;
+	P.field_ny = 4;
+
+	Simulation S(P);
+
+	scalar count = 0, vx = 0, vy = 0, v2 = 0;
+	for (int step = 0; step < 20; ++step)
+	{
+		try
+		{
+			S.step();
+		}
+		catch (int e)
+		{
+			S.report(e);
+			return 1;
+		}
+
+		for (auto &i : S.p)
+		{
+			count += 1;
+			vx += i.v.x;
+			vy += i.v.y;
+			v2 += i.v.x * i.v.x + i.v.y * i.v.y;
+		}
+	}
+
+	const coarse_fields &F = S.fields;
+	scalar fcount = 0, fvx = 0, fvy = 0, fv2 = 0;
+	for (int c = 0; c < F.nx * F.ny; ++c)
+	{
+		fcount += F.count[c];
+		fvx += F.vx[c];
+		fvy += F.vy[c];
+		fv2 += F.v2[c];
+	}
+
+	// Momenta are compared relative to the momentum scale N * v_max
+	scalar scale = max(count * velocity_max, scalar(1));
+	scalar error = abs(fcount - count) / max(count, scalar(1));
+	error = max(error, abs(fvx - vx) / scale);
+	error = max(error, abs(fvy - vy) / scale);
+	error = max(error, abs(fv2 - v2) / max(v2, scalar(1)));
+
+	return F.samples == 20 ? error : 1;
+}
+
+// Integrate a short simulation with one of the integrators (see
+// integrator.h), with steps small enough that the jumps of the force at
+// the cutoff don't dominate. Returns the relative change of the total
+// energy, and in potential_error the relative difference of the potential
+// energy from the box lists and the reference at the end.
+static scalar integrator_drift(const grid &G, integrator_scheme scheme, int threads, scalar &potential_error)
+{
+	parameters P = simulation_parameters(G, threads);
+	P.dt = dt / 10;
+	P.velocity_max = velocity_max;
+	P.integrator = scheme;
+
+	potential_error = 1;
+
+	try
+	{
+		Simulation S(P);
+		scalar E0 = S.kinetic_energy() + S.potential_energy();
+
+		S.step(200);
+
+		scalar U = S.potential_energy();
+		scalar reference = potential_energy(S.G, S.p);
+		potential_error = abs(U - reference) / max(abs(reference), scalar(1));
+
+		return abs(S.kinetic_energy() + U - E0) / max(abs(E0), scalar(1));
+	}
+	catch (int e)
+	{
+		return 1;
+	}
+}
+
+// Run a deterministic simulation with every thread count, setting it up
+// with 'configure', and return the number of particles that differ in any
+// bit from the run on a single thread (all of them if a run failed)
+template <class Configure>
+static size_t nondeterministic_particles(const grid &G, Configure configure)
+{
+	particle_list reference;
+	size_t differences = 0;
+
+	for (int threads = 1; threads <= max_threads; ++threads)
+	{
+		parameters P = simulation_parameters(G, threads);
+		P.deterministic = true;
+		configure(P);
+
+		try
+		{
+			Simulation S(P);
+			S.step(60);
+
+			if (threads == 1)
+			{
+				reference.assign(S.p.begin(), S.p.end());
+				continue;
+			}
+
+			if (S.p.size() != reference.size())
+				return P.N;
+
+			for (size_t i = 0; i < S.p.size(); ++i)
+			{
+				const particle &a = S.p[i];
+				const particle &b = reference[i];
+				differences += a.r.x != b.r.x || a.r.y != b.r.y || a.v.x != b.v.x || a.v.y != b.v.y ||
+							   a.F.x != b.F.x || a.F.y != b.F.y;
+			}
+		}
+		catch (int e)
+		{
+			return P.N;
+		}
+	}
+
+	return differences;
+}
+
+// Publish snapshots of a short simulation to a state segment, read the
+// latest one back and compare it with the particles of every box. Returns
+// the number of particles and cell offsets that differ, 1 if the
+// simulation or the segment failed.
+static size_t snapshot_errors(const grid &G, bool adaptive, int threads)
+{
+	parameters P = simulation_parameters(G, threads);
+	P.velocity_max = velocity_max;
+	P.adaptive = adaptive;
+	P.leaf_capacity = 2;
+
+	try
+	{
+		Simulation S(P);
+
+		snapshot_publisher E;
+		if (!E.open(snapshot_segment(getpid()), P.width, P.height, G.num_boxes_x, G.num_boxes_y, adaptive, P.N,
+					S.box.size() + 3 * P.N * P.max_depth / (P.leaf_capacity + 1)))
+			return 1;
+
+		// Both slots written, the latest one is the second
+		for (int publication = 0; publication < 3; ++publication)
+		{
+			S.step(5);
+			E.publish(S.p, S.box, S.steps, S.T);
+		}
+
+		const snapshot_header *H = attach_snapshots(snapshot_segment(getpid()));
+		if (!H)
+			return 1;
+
+		vector<particle> particles;
+		vector<uint64_t> offsets;
+		uint64_t steps;
+		double time;
+		bool read = read_snapshot(H, particles, offsets, steps, time);
+		detach_snapshots(H);
+
+		if (!read || steps != S.steps || offsets.size() != S.box.size() + 1 || particles.size() != S.p.size())
+			return 1;
+
+		size_t errors = 0;
+		for (size_t b = 0; b < S.box.size(); ++b)
+		{
+			errors += offsets[b + 1] - offsets[b] != S.box[b].size();
+			for (size_t k = 0; k < S.box[b].size() && offsets[b] + k < particles.size(); ++k)
+			{
+				const particle &a = particles[offsets[b] + k];
+				const particle &i = S.p[S.box[b][k]];
+				errors += a.r.x != i.r.x || a.r.y != i.r.y || a.v.x != i.v.x || a.v.y != i.v.y || a.F.x != i.F.x ||
+						  a.F.y != i.F.y;
+			}
+		}
+
+		return errors;
+	}
+	catch (int e)
+	{
+		return 1;
+	}
+}
+
+// Build the adaptive boxes of a clustered gas, and build them again after
+// the cluster dissolved into a uniform gas, as the simulation does every
+// tree_interval steps. Returns the number of inner nodes whose quadrants
+// hold no more than leaf_capacity particles together and should have been
+// merged, plus the particles missing from the leaves.
+static size_t unmerged_nodes(const grid &G, mt19937 &rng)
+{
+	quadtree Q(G.width, G.height, leaf_capacity, max_depth);
+	vector<vector<int>> box;
+	particle_list p;
+
+	size_t n = 40 * int(G.width * G.height) / 10;
+	clustered_gas(G, p, n, rng);
+	Q.build(p, box);
+
+	random_gas(G, p, n, rng);
+	Q.build(p, box);
+
+	// Particles below every node. Children come after their parent.
+	vector<size_t> count(Q.nodes.size(), 0);
+	for (int l = 0; l < Q.num_leaves(); ++l)
+		count[Q.leaf_node[l]] = box[l].size();
+
+	for (int k = Q.nodes.size() - 1; k >= 0; --k)
+		if (Q.nodes[k].child >= 0)
+			for (int q = 0; q < 4; ++q)
+				count[k] += count[Q.nodes[k].child + q];
+
+	size_t errors = 0;
+	size_t total = 0;
+	for (size_t k = 0; k < Q.nodes.size(); ++k)
+	{
+		errors += Q.nodes[k].child >= 0 && count[k] <= size_t(leaf_capacity);
+		if (int(k) < Q.G.num_boxes)
+			total += count[k];
+	}
+
+	return errors + (total != n ? n : 0);
+}
+
+// Run all checks on one grid. Returns the number of failed checks.
+static int validate_grid(const grid &G, const vector<variant> &variants, mt19937 &rng)
+{
+	int phases = Dispatcher(G).num_phases;
+
+	cout << "Validating " << G.num_boxes_x << "x" << G.num_boxes_y << " boxes (" << G.width << " x " << G.height
+		 << ", subdivision " << G.box_subdivision << ", " << phases << " phases)" << endl;
+
+	int failures = 0;
+
+	// Forces and pair distances on random configurations
+	for (int trial = 0; trial < 6; ++trial)
+	{
+		particle_list p;
+		string name;
+		uniform_int_distribution<int> un(2, 40 * int(G.width * G.height) / 10);
+
+		if (trial % 3 == 0)
+		{
+			name = "random gas";
+			random_gas(G, p, un(rng), rng);
+		}
+		else if (trial % 3 == 1)
+		{
+			name = "lattice";
+			uniform_real_distribution<scalar> us(0.9, 1.3);
+			jittered_lattice(G, p, us(rng), rng);
+		}
+		else
+		{
+			name = "clustered gas";
+			clustered_gas(G, p, un(rng), rng);
+		}
+
+		for (auto &V : variants)
+		{
+			string what = name + ", " + to_string(p.size()) + " particles, " + V.name + (V.numa ? " numa" : "") + ", " +
+						  to_string(V.threads) + " threads: ";
+
+			size_t rdf_errors;
+			scalar error = force_error(V, G, p, rdf_errors);
+			report("force  " + what + "error", error, force_tolerance, failures);
+			report("rdf    " + what + "pairs binned wrong", rdf_errors, 1, failures);
+		}
+	}
+
+	// Energy conservation
+	{
+		particle_list p;
+		jittered_lattice(G, p, 1.05, rng);
+
+		for (auto &V : variants)
+			report("energy " + to_string(p.size()) + " particles, " + V.name + (V.numa ? " numa" : "") + ", " +
+					   to_string(V.threads) + " threads: relative drift",
+				   energy_drift(V, G, p, 500), energy_tolerance, failures);
+	}
+
+	// Adaptive boxes of a region that thinned out
+	report("tree   dissolved cluster: nodes not merged", unmerged_nodes(G, rng), 1, failures);
+
+	// Complete simulations with their own initial layout, under every wall
+	report("layout initial grid, 20 steps: particles misplaced or broken", layout_errors(G), 1, failures);
+
+	for (int threads = 1; threads <= max_threads; ++threads)
+	{
+		string on = ", " + to_string(threads) + " threads: ";
+
+		// Incremental rebinning
+		for (bool numa : {false, true})
+			report(string("rebin  ") + (numa ? "numa" : "plain") + on + "particles misplaced",
+				   misplaced_particles(G, numa, threads), 1, failures);
+
+		// Task graph
+		for (auto &V : variants)
+			if (V.threads == threads && !V.numa)
+				report(string("tasks  ") + V.name + on + "error", task_graph_error(G, V.kernel, V.adaptive, threads),
+					   force_tolerance, failures);
+
+		// Block time steps
+		for (bool adaptive : {false, true})
+			report(string("block  ") + (adaptive ? "adaptive" : "plain") + on + "error",
+				   block_step_error(G, adaptive, threads), force_tolerance, failures);
+
+		// Temporal blocking
+		for (bool out_of_core : {false, true})
+			report(string("sweep  ") + (out_of_core ? "out of core" : "in memory") + on + "difference",
+				   temporal_error(G, threads, out_of_core), trajectory_tolerance, failures);
+		report("sweep  fast particle" + on + "error", fast_particle_error(G, threads), force_tolerance, failures);
+
+		// Coarse grained fields
+		report("fields" + on + "relative error", field_error(G, threads), force_tolerance, failures);
+
+		// Integrators
+		for (auto scheme : {INTEGRATOR_VERLET, INTEGRATOR_OMELYAN, INTEGRATOR_FOREST_RUTH, INTEGRATOR_RESPA})
+		{
+			scalar potential_error;
+			scalar drift = integrator_drift(G, scheme, threads, potential_error);
+			report(string("integr ") + scheme_name(scheme) + on + "relative drift", drift, energy_tolerance, failures);
+			report(string("integr ") + scheme_name(scheme) + on + "potential error", potential_error, force_tolerance,
+				   failures);
+		}
+
+		// State export
+		for (bool adaptive : {false, true})
+			report(string("export ") + (adaptive ? "adaptive" : "plain") + on + "values differ",
+				   snapshot_errors(G, adaptive, threads), 1, failures);
+	}
+
+	// Deterministic runs
+	string all = ", 1 to " + to_string(max_threads) + " threads: particles differ";
+
+	report("determ tiled" + all, nondeterministic_particles(G, [](parameters &P) { P.kernel = KERNEL_TILED; }), 1,
+		   failures);
+	report("determ direct" + all, nondeterministic_particles(G, [](parameters &P) { P.kernel = KERNEL_DIRECT; }), 1,
+		   failures);
+	report("determ adaptive" + all, nondeterministic_particles(G, [](parameters &P) { P.adaptive = true; }), 1,
+		   failures);
+	report("determ block" + all, nondeterministic_particles(G, [](parameters &P) {
+			   P.block_levels = 3;
+			   P.block_distance = 1e-2;
+		   }),
+		   1, failures);
+	report("determ sweep" + all, nondeterministic_particles(G, [](parameters &P) {
+			   P.temporal_block = 3;
+			   P.tile_columns = 2;
+		   }),
+		   1, failures);
+
+	return failures;
+}
+
+int main()
+{
+	// All variants, with up to three threads. The adaptive boxes have no
+	// NUMA layout.
+	vector<variant> variants;
+	for (int threads = 1; threads <= max_threads; ++threads)
+	{
+		for (bool numa : {false, true})
+		{
+			variants.push_back({"direct", KERNEL_DIRECT, numa, false, threads});
+			variants.push_back({"tiled", KERNEL_TILED, numa, false, threads});
+		}
+
+		variants.push_back({"adaptive direct", KERNEL_DIRECT, false, true, threads});
+		variants.push_back({"adaptive tiled", KERNEL_TILED, false, true, threads});
+	}
+
+	int failures = 0;
+	mt19937 rng(2017);
+
+	for (auto &g : grids)
+		failures += validate_grid(grid(g[0], g[1], int(g[2])), variants, rng);
+
+	if (failures)
+		cout << failures << " checks FAILED" << endl;
+	else
+		cout << "All checks passed" << endl;
+
+	return failures ? 1 : 0;
+}